@@ -0,0 +1,448 @@
+/* Measures emulation speed of SNES_SPC::play(), SNES_SPC::skip() and
+SPC_DSP::run() and reports the results as JSON on stdout.
+
+Usage: benchmark [-t seconds] [-r runs] [-b buffer_size] [-e accurate|fast]
+		[-c 0|1] [-j 0|1] [file.spc ...]
+
+Each SPC file given on the command line is measured, along with a few
+synthetic SPC programs built in memory, so the benchmark runs without any
+data files. Rates are in sample pairs (one left and one right sample) per
+second. Best of several runs is reported, along with a checksum of the
+generated audio so optimizations can be checked for exactness. -c 1 has all
+emulators share one decoded BRR block cache. -j 1 enables compiling of
+SPC-700 code to native code, where supported, so checksums can be compared
+with and without it.
+
+When built with SPC_CPU_PROFILE=1 or SPC_DSP_PROFILE=1 (make profile), the
+opcode or DSP profile of the last play() run of each SPC is written to
+stderr. */
+
+#include "snes_spc/SNES_SPC.h"
+#include "snes_spc/SPC_DSP.h"
+#include "snes_spc/SPC_BRR_Cache.h"
+
+#include "demo_util.h"
+
+#include <time.h>
+
+/* Synthetic SPC files */
+
+enum { spc_size = SNES_SPC::spc_file_size };
+
+/* Offsets into SPC file */
+enum {
+	spc_pc  = 0x25,
+	spc_sp  = 0x2B,
+	spc_ram = 0x100,
+	spc_dsp = 0x10100
+};
+
+/* SPC-700 programs, all loaded at $0200. Timer 0 ticks every 8 ms. */
+
+/* Waits for timer, then alternates between key-off of voices 4-7 and key-on
+of all voices with a new pitch every 16 ticks. */
+static unsigned char const dense_prog [] =
+{
+	0x8F,0x40,0xFA,      /*       MOV $FA,#$40  */
+	0x8F,0x01,0xF1,      /*       MOV $F1,#$01  */
+	0xEB,0xFD,           /* wait: MOV Y,$FD     */
+	0xF0,0xFC,           /*       BEQ wait      */
+	0xAB,0x00,           /*       INC $00       */
+	0xE4,0x00,           /*       MOV A,$00     */
+	0x28,0x0F,           /*       AND A,#$0F    */
+	0xD0,0xF4,           /*       BNE wait      */
+	0xE4,0x00,           /*       MOV A,$00     */
+	0x28,0x10,           /*       AND A,#$10    */
+	0xF0,0x08,           /*       BEQ kon       */
+	0x8F,0x5C,0xF2,      /*       MOV $F2,#$5C  */
+	0x8F,0xF0,0xF3,      /*       MOV $F3,#$F0  */
+	0x2F,0xE6,           /*       BRA wait      */
+	0x8F,0x5C,0xF2,      /* kon:  MOV $F2,#$5C  */
+	0x8F,0x00,0xF3,      /*       MOV $F3,#$00  */
+	0xAB,0x01,           /*       INC $01       */
+	0xE4,0x01,           /*       MOV A,$01     */
+	0x28,0x07,           /*       AND A,#$07    */
+	0x08,0x08,           /*       OR  A,#$08    */
+	0x8F,0x03,0xF2,      /*       MOV $F2,#$03  */
+	0xC4,0xF3,           /*       MOV $F3,A     */
+	0x8F,0x4C,0xF2,      /*       MOV $F2,#$4C  */
+	0x8F,0xFF,0xF3,      /*       MOV $F3,#$FF  */
+	0x2F,0xCB            /*       BRA wait      */
+};
+
+/* Same as dense_prog, but mixes two 256-byte buffers in software while
+waiting for the timer, like drivers that do their own sample processing. */
+static unsigned char const cpu_prog [] =
+{
+	0x8F,0x40,0xFA,      /*       MOV $FA,#$40      */
+	0x8F,0x01,0xF1,      /*       MOV $F1,#$01      */
+	0xCD,0x00,           /* work: MOV X,#$00        */
+	0xF5,0x00,0x20,      /* mix:  MOV A,$2000+X     */
+	0x60,                /*       CLRC              */
+	0x95,0x00,0x21,      /*       ADC A,$2100+X     */
+	0xD5,0x00,0x22,      /*       MOV $2200+X,A     */
+	0x3D,                /*       INC X             */
+	0xD0,0xF3,           /*       BNE mix           */
+	0xEB,0xFD,           /*       MOV Y,$FD         */
+	0xF0,0xED,           /*       BEQ work          */
+	0xAB,0x00,           /*       INC $00           */
+	0xE4,0x00,           /*       MOV A,$00         */
+	0x28,0x0F,           /*       AND A,#$0F        */
+	0xD0,0xE5,           /*       BNE work          */
+	0xE4,0x00,           /*       MOV A,$00         */
+	0x28,0x10,           /*       AND A,#$10        */
+	0xF0,0x08,           /*       BEQ kon           */
+	0x8F,0x5C,0xF2,      /*       MOV $F2,#$5C      */
+	0x8F,0xF0,0xF3,      /*       MOV $F3,#$F0      */
+	0x2F,0xD7,           /*       BRA work          */
+	0x8F,0x5C,0xF2,      /* kon:  MOV $F2,#$5C      */
+	0x8F,0x00,0xF3,      /*       MOV $F3,#$00      */
+	0xAB,0x01,           /*       INC $01           */
+	0xE4,0x01,           /*       MOV A,$01         */
+	0x28,0x07,           /*       AND A,#$07        */
+	0x08,0x08,           /*       OR  A,#$08        */
+	0x8F,0x03,0xF2,      /*       MOV $F2,#$03      */
+	0xC4,0xF3,           /*       MOV $F3,A         */
+	0x8F,0x4C,0xF2,      /*       MOV $F2,#$4C      */
+	0x8F,0xFF,0xF3,      /*       MOV $F3,#$FF      */
+	0x2F,0xBC            /*       BRA work          */
+};
+
+/* Only waits for timer, with all voices and echo off */
+static unsigned char const silent_prog [] =
+{
+	0x8F,0x40,0xFA,      /*       MOV $FA,#$40  */
+	0x8F,0x01,0xF1,      /*       MOV $F1,#$01  */
+	0xEB,0xFD,           /* wait: MOV Y,$FD     */
+	0xF0,0xFC,           /*       BEQ wait      */
+	0x2F,0xFA            /*       BRA wait      */
+};
+
+static unsigned rand_state;
+
+static int next_rand( void )
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 16 & 0xFF;
+}
+
+/* Writes BRR sample with given number of blocks, looping back to its start */
+static int make_brr( unsigned char* out, int blocks, int noisy )
+{
+	int i, j;
+	for ( i = 0; i < blocks; i++ )
+	{
+		int filter = i & 3;
+		int header = (noisy ? 0x80 : 0xB0) | filter << 2;
+		if ( i == blocks - 1 )
+			header |= 0x03; /* end and loop */
+		*out++ = (unsigned char) header;
+		for ( j = 0; j < 8; j++ )
+			*out++ = (unsigned char) (noisy ? next_rand() : (j < 4 ? 0x77 : 0x99));
+	}
+	return blocks * 9;
+}
+
+static void make_spc( unsigned char* spc, unsigned char const* prog, int prog_size, int silent )
+{
+	static unsigned char const fir [8] = { 0x58, 0xBF, 0xDB, 0xF0, 0xFE, 0x07, 0x0C, 0x0C };
+	unsigned char* ram = spc + spc_ram;
+	unsigned char* dsp = spc + spc_dsp;
+	int v, i;
+
+	memset( spc, 0, spc_size );
+	memcpy( spc, "SNES-SPC700 Sound File Data v0.30\x1A\x1A", 35 );
+	spc [0x23] = 26; /* no ID666 */
+	spc [0x24] = 30;
+	spc [spc_pc + 0] = 0x00;
+	spc [spc_pc + 1] = 0x02;
+	spc [spc_sp] = 0xEF;
+
+	memcpy( &ram [0x200], prog, prog_size );
+	ram [0xF0] = 0x0A;
+
+	/* Sample directory at $0300: sample 0 at $0400, sample 1 at $0480 */
+	rand_state = 1;
+	make_brr( &ram [0x400], 4, 0 );
+	make_brr( &ram [0x480], 8, 1 );
+	ram [0x300] = 0x00; ram [0x301] = 0x04; ram [0x302] = 0x00; ram [0x303] = 0x04;
+	ram [0x304] = 0x80; ram [0x305] = 0x04; ram [0x306] = 0x80; ram [0x307] = 0x04;
+
+	/* Buffers mixed by cpu_prog */
+	for ( i = 0x2000; i < 0x2200; i++ )
+		ram [i] = (unsigned char) next_rand();
+
+	for ( v = 0; v < 8; v++ )
+	{
+		unsigned char* r = &dsp [v * 0x10];
+		int pitch = 0x0800 + v * 0x180;
+		r [SPC_DSP::v_voll  ] = (unsigned char) (v == 6 ? -0x30 : 0x50 - v * 8);
+		r [SPC_DSP::v_volr  ] = (unsigned char) (0x30 + v * 4);
+		r [SPC_DSP::v_pitchl] = (unsigned char) pitch;
+		r [SPC_DSP::v_pitchh] = (unsigned char) (pitch >> 8);
+		r [SPC_DSP::v_srcn  ] = (unsigned char) (v & 1);
+		r [SPC_DSP::v_adsr0 ] = (unsigned char) (v == 7 ? 0x00 : 0x80 | v << 4 | 0x0A);
+		r [SPC_DSP::v_adsr1 ] = (unsigned char) (0x20 | v * 3);
+		r [SPC_DSP::v_gain  ] = 0xEC;
+		r [SPC_DSP::r_fir   ] = fir [v];
+	}
+
+	dsp [SPC_DSP::r_mvoll] = 0x7F;
+	dsp [SPC_DSP::r_mvolr] = 0x7F;
+	dsp [SPC_DSP::r_evoll] = (unsigned char) (silent ? 0 :  0x28);
+	dsp [SPC_DSP::r_evolr] = (unsigned char) (silent ? 0 : -0x28);
+	dsp [SPC_DSP::r_kon  ] = (unsigned char) (silent ? 0 : 0xFF);
+	dsp [SPC_DSP::r_flg  ] = (unsigned char) (silent ? 0x20 : 0x1C);
+	dsp [SPC_DSP::r_efb  ] = 0x50;
+	dsp [SPC_DSP::r_pmon ] = 0x04;
+	dsp [SPC_DSP::r_non  ] = 0x20;
+	dsp [SPC_DSP::r_eon  ] = 0x7E;
+	dsp [SPC_DSP::r_dir  ] = 0x03;
+	dsp [SPC_DSP::r_esa  ] = 0x80;
+	dsp [SPC_DSP::r_edl  ] = 0x03;
+}
+
+/* Timing */
+
+static double now( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* FNV-1a hash of samples */
+static unsigned long checksum( unsigned long h, short const* in, int count )
+{
+	int i;
+	for ( i = 0; i < count; i++ )
+	{
+		h = (h ^ (unsigned short) in [i]) * 0x01000193;
+		h &= 0xFFFFFFFF;
+	}
+	return h;
+}
+
+static unsigned long const checksum_init = 0x811C9DC5;
+
+/* Benchmarks */
+
+enum { max_buf_size = 0x10000 };
+static short buf [max_buf_size + 2];
+
+static int seconds  = 60;
+static int runs     = 3;
+static int buf_size = 2048;
+static SPC_DSP::engine_t engine = SPC_DSP::engine_accurate;
+static SPC_BRR_Cache* brr_cache;
+static int jit;
+
+/* Name of SPC being measured, and whether this is its last run */
+static const char* cur_name;
+static int last_run;
+
+typedef double (*bench_func_t)( unsigned char const* spc, long size, unsigned long* sum );
+
+static SNES_SPC* new_spc( unsigned char const* spc, long size )
+{
+	SNES_SPC* emu = new SNES_SPC;
+	if ( !emu ) error( "Out of memory" );
+	error( emu->init() );
+	emu->set_dsp_engine( engine );
+	emu->set_brr_cache( brr_cache );
+	emu->enable_jit( jit != 0 );
+	error( emu->load_spc( spc, size ) );
+	emu->clear_echo();
+	return emu;
+}
+
+static double bench_play( unsigned char const* spc, long size, unsigned long* sum )
+{
+	SNES_SPC* emu = new_spc( spc, size );
+	long remain = (long) seconds * SNES_SPC::sample_rate * 2;
+	unsigned long h = checksum_init;
+	double start = now();
+	while ( remain > 0 )
+	{
+		int n = (remain < buf_size ? (int) remain : buf_size);
+		error( emu->play( n, buf ) );
+		h = checksum( h, buf, n );
+		remain -= n;
+	}
+	double elapsed = now() - start;
+	*sum = h;
+
+	if ( last_run )
+	{
+		#if SPC_CPU_PROFILE
+			fprintf( stderr, "%s:\n", cur_name );
+			emu->cpu_profile().report( stderr );
+			fprintf( stderr, "\n" );
+		#endif
+
+		#if SPC_DSP_PROFILE
+			fprintf( stderr, "%s:\n", cur_name );
+			emu->dsp_profile().report( stderr );
+			fprintf( stderr, "\n" );
+		#endif
+	}
+
+	delete emu;
+	return elapsed;
+}
+
+static double bench_skip( unsigned char const* spc, long size, unsigned long* sum )
+{
+	SNES_SPC* emu = new_spc( spc, size );
+	double start = now();
+	error( emu->skip( seconds * SNES_SPC::sample_rate * 2 ) );
+	double elapsed = now() - start;
+
+	/* Verify state after skipping by hashing what plays next */
+	long remain = SNES_SPC::sample_rate * 2;
+	unsigned long h = checksum_init;
+	while ( remain > 0 )
+	{
+		int n = (remain < buf_size ? (int) remain : buf_size);
+		error( emu->play( n, buf ) );
+		h = checksum( h, buf, n );
+		remain -= n;
+	}
+	*sum = h;
+	delete emu;
+	return elapsed;
+}
+
+static double bench_dsp( unsigned char const* spc, long size, unsigned long* sum )
+{
+	static unsigned char ram [0x10000];
+	SPC_DSP* dsp = new SPC_DSP;
+	if ( !dsp ) error( "Out of memory" );
+	(void) size;
+	memcpy( ram, spc + spc_ram, sizeof ram );
+	dsp->init( ram );
+	dsp->set_engine( engine );
+	dsp->set_brr_cache( brr_cache );
+	dsp->load( spc + spc_dsp );
+
+	long remain = (long) seconds * SNES_SPC::sample_rate * 2;
+	unsigned long h = checksum_init;
+	double start = now();
+	while ( remain > 0 )
+	{
+		int n = (remain < buf_size ? (int) remain : buf_size);
+		/* room for one more pair keeps DSP from switching to its extra buffer */
+		dsp->set_output( buf, n + 2 );
+		dsp->run( n / 2 * SNES_SPC::clocks_per_sample );
+		h = checksum( h, buf, dsp->sample_count() );
+		remain -= n;
+	}
+	double elapsed = now() - start;
+	*sum = h;
+	delete dsp;
+	return elapsed;
+}
+
+static int first_result = 1;
+
+static void run_bench( const char* name, const char* source, const char* mode,
+		bench_func_t func, unsigned char const* spc, long size )
+{
+	double best = 0;
+	unsigned long sum = 0;
+	int i;
+	cur_name = name;
+	for ( i = 0; i < runs; i++ )
+	{
+		last_run = (i == runs - 1);
+		double t = func( spc, size, &sum );
+		if ( !i || t < best )
+			best = t;
+	}
+	if ( best <= 0 )
+		best = 1e-9;
+
+	double pairs = (double) seconds * SNES_SPC::sample_rate;
+	printf( "%s\n    { \"name\": \"%s\", \"source\": \"%s\", \"mode\": \"%s\", "
+			"\"emulated_seconds\": %d, \"host_seconds\": %.6f, "
+			"\"samples_per_sec\": %.0f, \"realtime_factor\": %.2f, "
+			"\"ns_per_dsp_clock\": %.4f, \"checksum\": \"%08lX\" }",
+			(first_result ? "" : ","), name, source, mode,
+			seconds, best, pairs / best, seconds / best,
+			best * 1e9 / (pairs * SNES_SPC::clocks_per_sample), sum );
+	fflush( stdout );
+	first_result = 0;
+}
+
+static void bench_spc( const char* name, const char* source, unsigned char const* spc, long size )
+{
+	run_bench( name, source, "play", bench_play, spc, size );
+	run_bench( name, source, "skip", bench_skip, spc, size );
+	run_bench( name, source, "dsp",  bench_dsp,  spc, size );
+}
+
+int main( int argc, char** argv )
+{
+	static unsigned char spc [spc_size];
+	int i;
+
+	for ( i = 1; i < argc && argv [i] [0] == '-'; i += 2 )
+	{
+		if ( i + 1 >= argc )
+			error( "Missing option value" );
+		switch ( argv [i] [1] )
+		{
+			case 't': seconds  = atoi( argv [i + 1] ); break;
+			case 'r': runs     = atoi( argv [i + 1] ); break;
+			case 'b': buf_size = atoi( argv [i + 1] ) & ~1; break;
+			case 'e':
+				if ( !strcmp( argv [i + 1], "fast" ) )
+					engine = SPC_DSP::engine_fast;
+				else if ( strcmp( argv [i + 1], "accurate" ) )
+					error( "Invalid engine" );
+				break;
+			case 'c':
+				if ( atoi( argv [i + 1] ) && !brr_cache )
+				{
+					brr_cache = new SPC_BRR_Cache;
+					if ( !brr_cache ) error( "Out of memory" );
+				}
+				break;
+			case 'j': jit = atoi( argv [i + 1] ); break;
+			default: error( "Usage: benchmark [-t seconds] [-r runs] [-b buffer_size] "
+					"[-e accurate|fast] [-c 0|1] [-j 0|1] [file.spc ...]" );
+		}
+	}
+	if ( seconds < 1 || runs < 1 || buf_size < 2 || buf_size > max_buf_size )
+		error( "Invalid option value" );
+
+	printf( "{\n  \"benchmark\": \"snes_spc\",\n  \"engine\": \"%s\",\n"
+			"  \"brr_cache\": %s,\n  \"jit\": %s,\n"
+			"  \"buffer_size\": %d,\n  \"runs\": %d,\n  \"results\": [",
+			(engine == SPC_DSP::engine_fast ? "fast" : "accurate"),
+			(brr_cache ? "true" : "false"), (jit ? "true" : "false"), buf_size, runs );
+
+	make_spc( spc, dense_prog, sizeof dense_prog, 0 );
+	bench_spc( "dense", "synthetic", spc, spc_size );
+
+	make_spc( spc, cpu_prog, sizeof cpu_prog, 0 );
+	bench_spc( "cpu", "synthetic", spc, spc_size );
+
+	make_spc( spc, silent_prog, sizeof silent_prog, 1 );
+	bench_spc( "silent", "synthetic", spc, spc_size );
+
+	for ( ; i < argc; i++ )
+	{
+		long size;
+		unsigned char* data = load_file( argv [i], &size );
+		if ( size > spc_size )
+			size = spc_size;
+		memset( spc, 0, spc_size );
+		memcpy( spc, data, size );
+		free( data );
+		bench_spc( argv [i], "file", spc, size );
+	}
+
+	printf( "\n  ]\n}\n" );
+	return 0;
+}
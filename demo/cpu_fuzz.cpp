@@ -0,0 +1,333 @@
+/* Differential test of the SPC-700 threaded code, native code and timer
+polling fast-forward against the plain interpreter.
+
+Usage: cpu_fuzz [-n count] [-s first_seed] [-j 0|1]
+
+Builds count random SPC-700 programs in memory and plays each one with
+normal and fast accuracy, writing to and reading from the ports between
+calls to play(). For each program a line with the seed and a checksum of
+the audio, port reads and final state (as saved by save_spc()) for each
+accuracy is written to stdout. -j 1 enables compiling of SPC-700 code to
+native code.
+
+Output of a build with SPC_CPU_THREADED=0, which only uses the interpreter,
+must be the same as output of a normal build with -j 0 and with -j 1. make
+verify builds both and compares them. */
+
+#include "snes_spc/SNES_SPC.h"
+
+#include "demo_util.h"
+
+/* Offsets into SPC file */
+enum {
+	spc_pc  = 0x25,
+	spc_a   = 0x27,
+	spc_x   = 0x28,
+	spc_y   = 0x29,
+	spc_psw = 0x2A,
+	spc_sp  = 0x2B,
+	spc_ram = 0x100,
+	spc_dsp = 0x10100
+};
+
+static unsigned rand_state;
+
+static int next_rand( void )
+{
+	rand_state = rand_state * 1103515245 + 12345;
+	return rand_state >> 16 & 0x7FFF;
+}
+
+/* Opcodes straight-line code is made of, with their lengths. The first ones
+are run as threaded code, the rest always by the interpreter. */
+struct op_t { unsigned char opcode, size; };
+static op_t const ops [] =
+{
+	{0xE8,2},{0xCD,2},{0x8D,2},{0x7D,1},{0xDD,1},{0x5D,1},{0xFD,1},{0xBC,1},
+	{0x3D,1},{0xFC,1},{0x9C,1},{0x1D,1},{0xDC,1},{0x68,2},{0xC8,2},{0xAD,2},
+	{0x28,2},{0x08,2},{0x48,2},{0x88,2},{0xA8,2},{0x60,1},{0x80,1},{0x00,1},
+	{0xE4,2},{0xF8,2},{0xEB,2},{0x64,2},{0x3E,2},{0x7E,2},{0x24,2},{0x04,2},
+	{0x44,2},{0x84,2},{0xA4,2},{0xE5,3},{0x65,3},{0xC4,2},{0xD8,2},{0xCB,2},
+	{0xAB,2},{0x8B,2},{0xC5,3},{0xAC,3},{0x8C,3},{0xF5,3},{0xF6,3},{0xF4,2},
+	{0xE6,1},{0xF7,2},{0xD5,3},{0xD6,3},{0xD4,2},{0xC6,1},{0xD7,2},
+	/* not threaded */
+	{0x8F,3},{0x20,1},{0x40,1},{0x2D,1},{0xAE,1},{0xEC,3},{0xC9,3},{0xFA,3},
+	{0x1C,1},{0x5C,1},{0x9F,1},{0xE9,3}
+};
+int const threaded_op_count = 55;
+int const op_count = sizeof ops / sizeof ops [0];
+
+/* Conditional branches */
+static unsigned char const branches [8] = { 0xF0, 0xD0, 0x30, 0x10, 0xB0, 0x90, 0x70, 0x50 };
+
+/* Direct page bytes used as loop counters, one per nesting depth */
+int const loop_counter = 0xEF;
+
+static unsigned char* ram;
+static int prog_start;
+static int prog_pc;
+static int mostly_threaded;
+
+/* Direct page operand: mostly low RAM, often timer outputs or other registers */
+static int rand_dp( void )
+{
+	int r = next_rand() % 16;
+	if ( r < 3 )
+		return 0xFD + next_rand() % 3;
+	if ( r == 3 )
+		return 0xF0 + next_rand() % 16;
+	if ( r < 10 )
+		return next_rand() % 0x40;
+	r = next_rand() & 0xFF;
+	return (r == loop_counter || r == loop_counter - 1 ? 0 : r);
+}
+
+/* Absolute operand: near code, a register, or low RAM */
+static int rand_abs( void )
+{
+	int r = next_rand() % 16;
+	if ( r == 0 )
+		return prog_pc + next_rand() % 40 - 20;
+	if ( r < 4 )
+		return 0xF0 + next_rand() % 16;
+	return 0x100 + next_rand() % 0x300;
+}
+
+static void emit( int n )
+{
+	ram [prog_pc++] = (unsigned char) n;
+}
+
+/* Emits random instruction that doesn't write register avoid ('X' or 'Y') */
+static void emit_op( int avoid )
+{
+	for ( ;; )
+	{
+		op_t const op = ops [next_rand() % (mostly_threaded && next_rand() % 4 ?
+				threaded_op_count : op_count)];
+		int const opcode = op.opcode;
+		if ( avoid == 'X' && memchr( "\xCD\x5D\x3D\x1D\xF8\xE9\xAE", opcode, 7 ) )
+			continue;
+		if ( avoid == 'Y' && memchr( "\x8D\xFD\xFC\xDC\xEB\xEC", opcode, 6 ) )
+			continue;
+
+		emit( opcode );
+		if ( op.size == 2 )
+		{
+			emit( rand_dp() );
+		}
+		else if ( op.size == 3 )
+		{
+			if ( opcode == 0x8F || opcode == 0xFA )
+			{
+				emit( next_rand() );
+				emit( rand_dp() );
+			}
+			else
+			{
+				int addr = rand_abs();
+				emit( addr );
+				emit( addr >> 8 );
+			}
+		}
+		return;
+	}
+}
+
+static void emit_ops( int n, int avoid )
+{
+	while ( n-- )
+		emit_op( avoid );
+}
+
+/* Emits short run of code with loops like those in sound drivers */
+static void emit_block( int depth, int avoid )
+{
+	switch ( next_rand() % 8 )
+	{
+		case 0:
+		case 1:
+		case 2:
+			emit_ops( next_rand() % 6 + 1, avoid );
+			break;
+
+		case 3: { /* if: conditional branch over a few instructions */
+			emit( branches [next_rand() % 8] );
+			int const offset = prog_pc++;
+			emit_ops( next_rand() % 4 + 1, avoid );
+			ram [offset] = (unsigned char) (prog_pc - offset - 1);
+			break;
+		}
+
+		case 4: /* timer polling, which threaded code fast-forwards */
+			emit( "\xE4\xF8\xEB" [next_rand() % 3] ); /* MOV A/X/Y,dp */
+			emit( 0xFD + next_rand() % 3 );
+			emit( 0xF0 ); /* BEQ back to MOV */
+			emit( 0xFC );
+			break;
+
+		default: { /* counted loop */
+			if ( depth > 1 )
+			{
+				emit_ops( next_rand() % 4 + 1, avoid );
+				break;
+			}
+			int kind = next_rand() % 3;
+			if ( avoid ) /* register of outer loop */
+				kind = 2;
+			int const count = next_rand() % 16 + 1;
+			int loop;
+			if ( kind == 0 )
+			{
+				emit( 0x8D ); emit( count ); /* MOV Y,#count */
+				loop = prog_pc;
+				emit_block( depth + 1, 'Y' );
+				emit_block( depth + 1, 'Y' );
+				emit( 0xFE ); /* DBNZ Y,loop */
+			}
+			else if ( kind == 1 )
+			{
+				emit( 0xCD ); emit( count ); /* MOV X,#count */
+				loop = prog_pc;
+				emit_block( depth + 1, 'X' );
+				emit_block( depth + 1, 'X' );
+				emit( 0x1D ); /* DEC X */
+				emit( 0xD0 ); /* BNE loop */
+			}
+			else
+			{
+				emit( 0x8F ); emit( count ); emit( loop_counter - depth ); /* MOV dp,#count */
+				loop = prog_pc;
+				emit_block( depth + 1, avoid );
+				emit_block( depth + 1, avoid );
+				emit( 0x6E ); emit( loop_counter - depth ); /* DBNZ dp,loop */
+			}
+			emit( loop - prog_pc - 1 );
+			break;
+		}
+	}
+}
+
+/* Builds SPC file with random program, registers and DSP state */
+static void make_spc( unsigned char* spc, int seed )
+{
+	int i;
+	memset( spc, 0, SNES_SPC::spc_file_size );
+	memcpy( spc, "SNES-SPC700 Sound File Data v0.30\x1A\x1A", 35 );
+	rand_state = seed;
+
+	ram = spc + spc_ram;
+	for ( i = 0; i < 0x10000; i++ )
+		ram [i] = (unsigned char) next_rand();
+
+	/* Timers running with random periods */
+	for ( i = 0xF0; i < 0x100; i++ )
+		ram [i] = 0;
+	ram [0xF1] = 0x07 | (next_rand() & 0x80);
+	ram [0xFA] = (unsigned char) next_rand();
+	ram [0xFB] = (unsigned char) next_rand();
+	ram [0xFC] = (unsigned char) next_rand();
+
+	/* Program repeating random blocks */
+	prog_start = 0x200 + next_rand() % 0x200 * 0x40;
+	prog_pc = prog_start;
+	mostly_threaded = !(seed % 3);
+	int n = 20 + next_rand() % 60;
+	while ( n-- )
+		emit_block( 0, 0 );
+	emit( 0x5F ); /* JMP prog_start */
+	emit( prog_start );
+	emit( prog_start >> 8 );
+
+	spc [spc_pc    ] = (unsigned char) prog_start;
+	spc [spc_pc + 1] = (unsigned char) (prog_start >> 8);
+	spc [spc_a  ] = (unsigned char) next_rand();
+	spc [spc_x  ] = (unsigned char) next_rand();
+	spc [spc_y  ] = (unsigned char) next_rand();
+	spc [spc_psw] = (unsigned char) ((next_rand() & ~0x20) | (next_rand() % 4 ? 0 : 0x20));
+	spc [spc_sp ] = 0xEF;
+
+	/* Random DSP state, with echo writes sometimes enabled */
+	unsigned char* dsp = spc + spc_dsp;
+	for ( i = 0; i < 128; i++ )
+		dsp [i] = (unsigned char) next_rand();
+	dsp [SPC_DSP::r_flg] = (unsigned char) (next_rand() % 2 ? 0x00 : 0x20 | (next_rand() & 0x1F));
+	dsp [SPC_DSP::r_edl] = (unsigned char) (next_rand() & 3);
+	dsp [SPC_DSP::r_esa] = (unsigned char) (next_rand() % 0xF0);
+}
+
+/* FNV-1a hash */
+static unsigned long hash( unsigned long h, int n )
+{
+	return ((h ^ (n & 0xFFFF)) * 0x01000193) & 0xFFFFFFFF;
+}
+
+/* Plays SPC and returns checksum of everything it does */
+static unsigned long run( unsigned char const* spc, SNES_SPC::accuracy_t accuracy,
+		int jit, int seed )
+{
+	SNES_SPC* emu = new SNES_SPC;
+	if ( !emu ) error( "Out of memory" );
+	error( emu->init() );
+	emu->set_accuracy( accuracy );
+	emu->enable_jit( jit != 0 );
+	error( emu->load_spc( spc, SNES_SPC::spc_file_size ) );
+
+	/* Emulation errors are part of the result */
+	rand_state = seed;
+	unsigned long h = 0x811C9DC5;
+	static short out [1024 * 2];
+	int i;
+	for ( i = 0; i < 300; i++ )
+	{
+		int const count = (next_rand() % 1024 + 1) * 2;
+		h = hash( h, emu->play( count, out ) != 0 );
+		int j;
+		for ( j = 0; j < count; j++ )
+			h = hash( h, out [j] );
+
+		if ( next_rand() % 8 == 0 )
+			emu->write_port( 5, next_rand() % 4, next_rand() & 0xFF );
+		if ( next_rand() % 8 == 0 )
+			h = hash( h, emu->read_port( 10, next_rand() % 4 ) );
+	}
+
+	static unsigned char state [SNES_SPC::spc_file_size];
+	emu->save_spc( state );
+	for ( i = 0; i < (int) sizeof state; i++ )
+		h = hash( h, state [i] );
+
+	delete emu;
+	return h;
+}
+
+int main( int argc, char** argv )
+{
+	static unsigned char spc [SNES_SPC::spc_file_size];
+	int count = 300;
+	int first = 1;
+	int jit = 0;
+	int i;
+
+	for ( i = 1; i < argc; i += 2 )
+	{
+		if ( argv [i] [0] != '-' || i + 1 >= argc )
+			error( "Usage: cpu_fuzz [-n count] [-s first_seed] [-j 0|1]" );
+		switch ( argv [i] [1] )
+		{
+			case 'n': count = atoi( argv [i + 1] ); break;
+			case 's': first = atoi( argv [i + 1] ); break;
+			case 'j': jit   = atoi( argv [i + 1] ); break;
+			default: error( "Usage: cpu_fuzz [-n count] [-s first_seed] [-j 0|1]" );
+		}
+	}
+
+	for ( i = first; i < first + count; i++ )
+	{
+		make_spc( spc, i );
+		printf( "%d %08lX %08lX\n", i,
+				run( spc, SNES_SPC::accuracy_normal, jit, i ),
+				run( spc, SNES_SPC::accuracy_fast,   jit, i ) );
+	}
+	return 0;
+}
@@ -11,19 +11,21 @@
 SNES_SPC* snes_spc = NULL;
 SPC_Filter* filter = NULL;
 
+/* Output rate; emulator resamples from its native 32 kHz */
+static int const sample_rate = 48000;
+
 // Callback function for audio playback
 static int audioCallback(const void *inputBuffer, void *outputBuffer,
                          unsigned long framesPerBuffer,
                          const PaStreamCallbackTimeInfo *timeInfo,
                          PaStreamCallbackFlags statusFlags,
                          void *userData) {
-    float *out = (float *)outputBuffer;
+    short *out = (short *)outputBuffer;
+    int count = (int) framesPerBuffer * 2; /* stereo */
     (void)inputBuffer; // Prevent unused variable warning
 
-	error(snes_spc->play(framesPerBuffer, (short*)outputBuffer));
-
-	/* Filter samples */
-	filter->run((short*)outputBuffer, framesPerBuffer);
+	/* Emulator filters samples as it generates them */
+	error(snes_spc->play_resampled(count, out, sample_rate));
 
     return paContinue;
 }
@@ -37,6 +39,8 @@ int main(int argc, char** argv) {
 
 	if ( !snes_spc || !filter ) error( "Out of memory" );
 
+	snes_spc->set_filter( filter );
+
 	/* Load SPC */
 	{
 		/* Load file into memory */
@@ -64,7 +68,7 @@ int main(int argc, char** argv) {
     }
 
     int frames_per_buffer = 2048;
-    err = Pa_OpenDefaultStream(&stream, 0, 1, paInt16, SNES_SPC::sample_rate * 2, frames_per_buffer, audioCallback, NULL);
+    err = Pa_OpenDefaultStream(&stream, 0, 2, paInt16, sample_rate, frames_per_buffer, audioCallback, NULL);
     if (err != paNoError) {
         fprintf(stderr, "PortAudio error: %s\n", Pa_GetErrorText(err));
         return 1;
@@ -26,12 +26,6 @@ static inline void dprintf( const char*, ... ) { }
 // (n ? n : 256)
 #define IF_0_THEN_256( n ) ((uint8_t) ((n) - 1) + 1)
 
-// Note: SPC_MORE_ACCURACY exists mainly so I can run my validation tests, which
-// do crazy echo buffer accesses.
-#ifndef SPC_MORE_ACCURACY
-	#define SPC_MORE_ACCURACY 0
-#endif
-
 #ifdef BLARGG_ENABLE_OPTIMIZER
 	#include BLARGG_ENABLE_OPTIMIZER
 #endif
@@ -87,56 +81,83 @@ void SNES_SPC::enable_rom( int enable )
 			memcpy( m.hi_ram, &RAM [rom_addr], sizeof m.hi_ram );
 		memcpy( &RAM [rom_addr], (enable ? m.rom : m.hi_ram), rom_size );
 		// TODO: ROM can still get overwritten when DSP writes to echo buffer
+		update_pages();
 	}
 }
 
 
-//// DSP
+//// Memory pages
 
-#if SPC_LESS_ACCURATE
-	int const max_reg_time = 29;
+void SNES_SPC::update_pages()
+{
+	memset( m.pages, 0, sizeof m.pages );
+	m.pages [0] = page_io;
+	if ( m.rom_enabled )
+		m.pages [rom_addr >> 8] = page_rom;
 
-	signed char const SNES_SPC::reg_times_ [256] =
+	if ( !(dsp.read( SPC_DSP::r_flg ) & 0x20) )
 	{
-		 -1,  0,-11,-10,-15,-11, -2, -2,  4,  3, 14, 14, 26, 26, 14, 22,
-		  2,  3,  0,  1,-12,  0,  1,  1,  7,  6, 14, 14, 27, 14, 14, 23,
-		  5,  6,  3,  4, -1,  3,  4,  4, 10,  9, 14, 14, 26, -5, 14, 23,
-		  8,  9,  6,  7,  2,  6,  7,  7, 13, 12, 14, 14, 27, -4, 14, 24,
-		 11, 12,  9, 10,  5,  9, 10, 10, 16, 15, 14, 14, -2, -4, 14, 24,
-		 14, 15, 12, 13,  8, 12, 13, 13, 19, 18, 14, 14, -2,-36, 14, 24,
-		 17, 18, 15, 16, 11, 15, 16, 16, 22, 21, 14, 14, 28, -3, 14, 25,
-		 20, 21, 18, 19, 14, 18, 19, 19, 25, 24, 14, 14, 14, 29, 14, 25,
-
-		 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
-		 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
-		 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
-		 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
-		 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
-		 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
-		 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
-		 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
-	};
-
-	#define RUN_DSP( time, offset ) \
-		int count = (time) - (offset) - m.dsp_time;\
-		if ( count >= 0 )\
-		{\
-			int clock_count = (count & ~(clocks_per_sample - 1)) + clocks_per_sample;\
-			m.dsp_time += clock_count;\
-			dsp.run( clock_count );\
-		}
-#else
-	#define RUN_DSP( time, offset ) \
+		// Echo buffer is 2K per EDL unit, or 4 bytes if EDL is 0, and wraps
+		// around at end of memory
+		int start = dsp.read( SPC_DSP::r_esa );
+		int count = (dsp.read( SPC_DSP::r_edl ) & 0x0F) * 8;
+		if ( !count )
+			count = 1;
+		for ( int i = 0; i < count; i++ )
+			m.pages [(start + i) & 0xFF] |= page_echo;
+	}
+}
+
+
+//// DSP
+
+int const max_reg_time = 29;
+
+// Clocks DSP runs ahead of or behind access to each of its registers, for
+// fast accuracy
+signed char const SNES_SPC::reg_times_ [256] =
+{
+	 -1,  0,-11,-10,-15,-11, -2, -2,  4,  3, 14, 14, 26, 26, 14, 22,
+	  2,  3,  0,  1,-12,  0,  1,  1,  7,  6, 14, 14, 27, 14, 14, 23,
+	  5,  6,  3,  4, -1,  3,  4,  4, 10,  9, 14, 14, 26, -5, 14, 23,
+	  8,  9,  6,  7,  2,  6,  7,  7, 13, 12, 14, 14, 27, -4, 14, 24,
+	 11, 12,  9, 10,  5,  9, 10, 10, 16, 15, 14, 14, -2, -4, 14, 24,
+	 14, 15, 12, 13,  8, 12, 13, 13, 19, 18, 14, 14, -2,-36, 14, 24,
+	 17, 18, 15, 16, 11, 15, 16, 16, 22, 21, 14, 14, 28, -3, 14, 25,
+	 20, 21, 18, 19, 14, 18, 19, 19, 25, 24, 14, 14, 14, 29, 14, 25,
+
+	 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+	 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+	 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+	 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+	 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+	 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+	 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+	 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+};
+
+// Catches DSP up to time. Fast accuracy runs DSP only in whole samples, far
+// enough that the register accessed is up to date.
+#define RUN_DSP( time, offset ) \
+	{\
+		int count = (time) - m.dsp_time;\
+		if ( m.accuracy == accuracy_fast )\
 		{\
-			int count = (time) - m.dsp_time;\
-			if ( !SPC_MORE_ACCURACY || count )\
+			count -= (offset);\
+			if ( count >= 0 )\
 			{\
-				assert( count > 0 );\
-				m.dsp_time = (time);\
-				dsp.run( count );\
+				int clock_count = (count & ~(clocks_per_sample - 1)) + clocks_per_sample;\
+				m.dsp_time += clock_count;\
+				dsp.run( clock_count );\
 			}\
-		}
-#endif
+		}\
+		else if ( m.accuracy != accuracy_high || count )\
+		{\
+			assert( count > 0 );\
+			m.dsp_time = (time);\
+			dsp.run( count );\
+		}\
+	}
 
 int SNES_SPC::dsp_read( rel_time_t time )
 {
@@ -153,50 +174,50 @@ int SNES_SPC::dsp_read( rel_time_t time )
 
 inline void SNES_SPC::dsp_write( int data, rel_time_t time )
 {
-	RUN_DSP( time, reg_times [REGS [r_dspaddr]] )
-	#if SPC_LESS_ACCURATE
-		else if ( m.dsp_time == skipping_time )
-		{
-			int r = REGS [r_dspaddr];
-			if ( r == SPC_DSP::r_kon )
-				m.skipped_kon |= data & ~dsp.read( SPC_DSP::r_koff );
+	if ( m.accuracy == accuracy_fast && m.dsp_time == skipping_time )
+	{
+		// skip() isn't running DSP, so just keep track of key on and off
+		int r = REGS [r_dspaddr];
+		if ( r == SPC_DSP::r_kon )
+			m.skipped_kon |= data & ~dsp.read( SPC_DSP::r_koff );
 
-			if ( r == SPC_DSP::r_koff )
-			{
-				m.skipped_koff |= data;
-				m.skipped_kon &= ~data;
-			}
+		if ( r == SPC_DSP::r_koff )
+		{
+			m.skipped_koff |= data;
+			m.skipped_kon &= ~data;
 		}
-	#endif
+	}
+	else
+	{
+		RUN_DSP( time, reg_times [REGS [r_dspaddr]] )
+	}
 
 	#ifdef SPC_DSP_WRITE_HOOK
 		SPC_DSP_WRITE_HOOK( m.spc_time + time, REGS [r_dspaddr], (uint8_t) data );
 	#endif
 
 	if ( REGS [r_dspaddr] <= 0x7F )
+	{
 		dsp.write( REGS [r_dspaddr], data );
-	else if ( !SPC_MORE_ACCURACY )
+
+		int r = REGS [r_dspaddr];
+		if ( r == SPC_DSP::r_esa || r == SPC_DSP::r_edl || r == SPC_DSP::r_flg )
+			update_pages();
+	}
+	else if ( m.accuracy != accuracy_high )
 		dprintf( "SPC wrote to DSP register > $7F\n" );
 }
 
 
 //// Memory access extras
 
-#if SPC_MORE_ACCURACY
-	#define MEM_ACCESS( time, addr ) \
-	{\
-		if ( time >= m.dsp_time )\
-		{\
-			RUN_DSP( time, max_reg_time );\
-		}\
-	}
-#elif !defined (NDEBUG)
+#if !defined (NDEBUG)
 	// Debug-only check for read/write within echo buffer, since this might result in
 	// inaccurate emulation due to the DSP not being caught up to the present.
 
 	bool SNES_SPC::check_echo_access( int addr )
 	{
-		if ( !(dsp.read( SPC_DSP::r_flg ) & 0x20) )
+		if ( m.pages [addr >> 8 & 0xFF] & page_echo )
 		{
 			int start = 0x100 * dsp.read( SPC_DSP::r_esa );
 			int size  = 0x800 * (dsp.read( SPC_DSP::r_edl ) & 0x0F);
@@ -247,7 +268,7 @@ void SNES_SPC::cpu_write_smp_reg_( int data, rel_time_t time, int addr )
 	case r_t0out:
 	case r_t1out:
 	case r_t2out:
-		if ( !SPC_MORE_ACCURACY )
+		if ( m.accuracy != accuracy_high )
 			dprintf( "SPC wrote to counter %d\n", (int) addr - r_t0out );
 
 		if ( data < no_read_before_write  / 2 )
@@ -333,6 +354,9 @@ void SNES_SPC::cpu_write( int data, int addr, rel_time_t time )
 
 	// RAM
 	RAM [addr] = (uint8_t) data;
+	if ( !(m.pages [addr >> 8 & 0xFF] & (page_io | page_rom)) )
+		return;
+
 	int reg = addr - 0xF0;
 	if ( reg >= 0 ) // 64%
 	{
@@ -387,6 +411,9 @@ int SNES_SPC::cpu_read( int addr, rel_time_t time )
 
 	// RAM
 	int result = RAM [addr];
+	if ( !(m.pages [addr >> 8 & 0xFF] & page_io) )
+		return result;
+
 	int reg = addr - 0xF0;
 	if ( reg >= 0 ) // 40%
 	{
@@ -425,7 +452,8 @@ int SNES_SPC::cpu_read( int addr, rel_time_t time )
 
 // Prefix and suffix for CPU emulator function
 #define SPC_CPU_RUN_FUNC \
-uint8_t* SNES_SPC::run_until_( time_t end_time )\
+template<int accuracy>\
+uint8_t* SNES_SPC::run_cpu( time_t end_time )\
 {\
 	rel_time_t rel_time = m.spc_time - end_time;\
 	assert( rel_time <= 0 );\
@@ -473,15 +501,15 @@ void SNES_SPC::end_frame( time_t end_time )
 	}
 
 	// Save any extra samples beyond what should be generated
-	if ( m.buf_begin )
+	if ( m.has_output )
 		save_extra();
 }
 
-#if SPC_MORE_ACCURACY
-	#define SUSPICIOUS_OPCODE( name ) ((void) 0)
-#else
-	#define SUSPICIOUS_OPCODE( name ) dprintf( "SPC: suspicious opcode: " name "\n" )
-#endif
+#define SUSPICIOUS_OPCODE( name ) \
+	{\
+		if ( accuracy != accuracy_high )\
+			dprintf( "SPC: suspicious opcode: " name "\n" );\
+	}
 
 #define CPU_READ( time, offset, addr )\
 	cpu_read( addr, time + offset )
@@ -489,18 +517,17 @@ void SNES_SPC::end_frame( time_t end_time )
 #define CPU_WRITE( time, offset, addr, data )\
 	cpu_write( data, addr, time + offset )
 
-#if SPC_MORE_ACCURACY
-	#define CPU_READ_TIMER( time, offset, addr, out )\
-		{ out = CPU_READ( time, offset, addr ); }
-
-#else
-	// timers are by far the most common thing read from dp
-	#define CPU_READ_TIMER( time, offset, addr_, out )\
+// timers are by far the most common thing read from dp
+#define CPU_READ_TIMER( time, offset, addr_, out )\
 	{\
 		rel_time_t adj_time = time + offset;\
 		int dp_addr = addr_;\
 		int ti = dp_addr - (r_t0out + 0xF0);\
-		if ( (unsigned) ti < timer_count )\
+		if ( accuracy == accuracy_high )\
+		{\
+			out = cpu_read( dp_addr, adj_time );\
+		}\
+		else if ( (unsigned) ti < timer_count )\
 		{\
 			Timer* t = &m.timers [ti];\
 			if ( adj_time >= t->next_time )\
@@ -516,7 +543,6 @@ void SNES_SPC::end_frame( time_t end_time )
 				out = cpu_read_smp_reg( i, adj_time );\
 		}\
 	}
-#endif
 
 #define TIME_ADJ( n )   (n)
 
@@ -624,6 +650,180 @@ int const nz_neg_mask = 0x880; // either bit set indicates N flag set
 	nz  = (in << 4 & 0x800) | (~in & z02);\
 }
 
+#if SPC_CPU_THREADED
+
+//// Threaded code
+
+void SNES_SPC::cpu_decode_block( cpu_block_t* b, int addr, void* const handlers [] )
+{
+	uint8_t const* const ram = RAM;
+	cpu_op_t* op = b->ops;
+	int time = 0;
+	int pc = addr;
+	while ( op < &b->ops [cpu_block_ops] && pc < 0x10000 - 3 )
+	{
+		int const opcode = ram [pc];
+		int const word   = get_le16( &ram [pc + 1] );
+		int arg    = ram [pc + 1];
+		int target = 0;
+		int len    = 2;
+		int kind;
+		switch ( opcode )
+		{
+		case 0xE8: kind = blk_mov_a_imm; break;
+		case 0xCD: kind = blk_mov_x_imm; break;
+		case 0x8D: kind = blk_mov_y_imm; break;
+		case 0x7D: kind = blk_mov_a_x; len = 1; break;
+		case 0xDD: kind = blk_mov_a_y; len = 1; break;
+		case 0x5D: kind = blk_mov_x_a; len = 1; break;
+		case 0xFD: kind = blk_mov_y_a; len = 1; break;
+		case 0xBC: kind = blk_inc_a;   len = 1; break;
+		case 0x3D: kind = blk_inc_x;   len = 1; break;
+		case 0xFC: kind = blk_inc_y;   len = 1; break;
+		case 0x9C: kind = blk_dec_a;   len = 1; break;
+		case 0x1D: kind = blk_dec_x;   len = 1; break;
+		case 0xDC: kind = blk_dec_y;   len = 1; break;
+		case 0x68: kind = blk_cmp_a_imm; break;
+		case 0xC8: kind = blk_cmp_x_imm; break;
+		case 0xAD: kind = blk_cmp_y_imm; break;
+		case 0x28: kind = blk_and_imm; break;
+		case 0x08: kind = blk_or_imm;  break;
+		case 0x48: kind = blk_eor_imm; break;
+		case 0x88: kind = blk_adc_imm; break;
+		case 0xA8: kind = blk_adc_imm; arg ^= 0xFF; break; // SBC imm
+		case 0x60: kind = blk_clrc;    len = 1; break;
+		case 0x80: kind = blk_setc;    len = 1; break;
+		case 0x00: kind = blk_nop;     len = 1; break;
+
+		// Reading $F3 runs DSP, which might write echo to RAM
+		case 0xE4: kind = blk_mov_a_dp;  goto read;
+		case 0xF8: kind = blk_mov_x_dp;  goto read;
+		case 0xEB: kind = blk_mov_y_dp;  goto read;
+		case 0x64: kind = blk_cmp_a_dp;  goto read;
+		case 0x3E: kind = blk_cmp_x_dp;  goto read;
+		case 0x7E: kind = blk_cmp_y_dp;  goto read;
+		case 0x24: kind = blk_and_dp;    goto read;
+		case 0x04: kind = blk_or_dp;     goto read;
+		case 0x44: kind = blk_eor_dp;    goto read;
+		case 0x84: kind = blk_adc_dp;    goto read;
+		case 0xA4: kind = blk_sbc_dp;    goto read;
+		case 0xE5: kind = blk_mov_a_abs; goto read_abs;
+		case 0x65: kind = blk_cmp_a_abs; goto read_abs;
+
+		// Writes to $F0-$FF have side effects, so they end block
+		case 0xC4: kind = blk_mov_dp_a;  goto write;
+		case 0xD8: kind = blk_mov_dp_x;  goto write;
+		case 0xCB: kind = blk_mov_dp_y;  goto write;
+		case 0xAB: kind = blk_inc_dp;    goto write;
+		case 0x8B: kind = blk_dec_dp;    goto write;
+		case 0xC5: kind = blk_mov_abs_a; goto write_abs;
+		case 0xAC: kind = blk_inc_abs;   goto write_abs;
+		case 0x8C: kind = blk_dec_abs;   goto write_abs;
+
+		// Indexed accesses are checked as they run
+		case 0xF5: kind = blk_mov_a_absx; len = 3; arg = word; break;
+		case 0xF6: kind = blk_mov_a_absy; len = 3; arg = word; break;
+		case 0xF4: kind = blk_mov_a_dpx;  break;
+		case 0xE6: kind = blk_mov_a_ix;   len = 1; break;
+		case 0xF7: kind = blk_mov_a_idy;  break;
+		case 0xD5: kind = blk_mov_absx_a; len = 3; arg = word; break;
+		case 0xD6: kind = blk_mov_absy_a; len = 3; arg = word; break;
+		case 0xD4: kind = blk_mov_dpx_a;  break;
+		case 0xC6: kind = blk_mov_ix_a;   len = 1; break;
+		case 0xD7: kind = blk_mov_idy_a;  break;
+
+		// Branches
+		case 0x2F: kind = blk_bra; goto branch;
+		case 0xF0: kind = blk_beq; goto branch;
+		case 0xD0: kind = blk_bne; goto branch;
+		case 0x30: kind = blk_bmi; goto branch;
+		case 0x10: kind = blk_bpl; goto branch;
+		case 0xB0: kind = blk_bcs; goto branch;
+		case 0x90: kind = blk_bcc; goto branch;
+		case 0x70: kind = blk_bvs; goto branch;
+		case 0x50: kind = blk_bvc; goto branch;
+		case 0xFE: kind = blk_dbnz_y; goto branch;
+		case 0x5F: kind = blk_jmp; len = 3; target = word; break;
+		case 0x2E:
+			kind = blk_cbne_dp;
+			len = 3;
+			target = pc + 3 + (int8_t) ram [pc + 2];
+			goto read;
+		case 0x6E:
+			kind = blk_dbnz_dp;
+			len = 3;
+			target = pc + 3 + (int8_t) ram [pc + 2];
+			goto write;
+
+		default:
+			goto end;
+
+		branch:
+			target = pc + 2 + (int8_t) arg;
+			break;
+		read_abs:
+			len = 3;
+			arg = word;
+		read:
+			if ( arg == r_dspdata + 0xF0 )
+				goto end;
+			break;
+		write_abs:
+			len = 3;
+			arg = word;
+		write:
+			if ( (unsigned) (arg - 0xF0) < reg_count )
+				goto end;
+			break;
+		}
+
+		// Branches out of memory are left to interpreter
+		if ( (unsigned) target > 0xFFFF )
+			goto end;
+
+		time += m.cycle_table [opcode];
+		pc   += len;
+		op->handler = handlers [kind];
+		op->time    = time;
+		op->addr    = arg;
+		op->next    = pc;
+		op->target  = target;
+		op++;
+
+		if ( kind == blk_bra || kind == blk_jmp )
+			goto done;
+	}
+end:
+	// Return to interpreter at following instruction
+	op->handler = handlers [blk_exit];
+	op->time    = time;
+	op->next    = pc;
+done:
+
+	// Always have at least one byte of code so that a block with no
+	// instructions is decoded again if its first instruction changes
+	b->pc   = addr;
+	b->time = time;
+	b->size = (pc > addr ? pc - addr : 1);
+	memcpy( b->code, &ram [addr], b->size );
+
+	// Loop polling timer output, i.e. MOV A,$FD / BEQ back to MOV
+	b->timer = -1;
+	if ( (b->ops [0].handler == handlers [blk_mov_a_dp] ||
+			b->ops [0].handler == handlers [blk_mov_x_dp] ||
+			b->ops [0].handler == handlers [blk_mov_y_dp]) &&
+			(unsigned) (b->ops [0].addr - (r_t0out + 0xF0)) < timer_count &&
+			b->ops [1].handler == handlers [blk_beq] && b->ops [1].target == addr )
+		b->timer = b->ops [0].addr - (r_t0out + 0xF0);
+
+	#if SPC_CPU_JIT
+		b->native = 0;
+		b->runs   = 0;
+	#endif
+}
+
+#endif
+
 SPC_CPU_RUN_FUNC
 {
 	uint8_t* const ram = RAM;
@@ -641,15 +841,366 @@ SPC_CPU_RUN_FUNC
 	SET_SP( m.cpu_regs.sp );
 	SET_PSW( m.cpu_regs.psw );
 
+	#if SPC_CPU_THREADED
+		static void* const block_handlers [blk_handler_count] = {
+			&&blk_exit,
+			&&blk_mov_a_imm, &&blk_mov_x_imm, &&blk_mov_y_imm,
+			&&blk_mov_a_x, &&blk_mov_a_y, &&blk_mov_x_a, &&blk_mov_y_a,
+			&&blk_inc_a, &&blk_inc_x, &&blk_inc_y, &&blk_dec_a, &&blk_dec_x, &&blk_dec_y,
+			&&blk_cmp_a_imm, &&blk_cmp_x_imm, &&blk_cmp_y_imm,
+			&&blk_and_imm, &&blk_or_imm, &&blk_eor_imm, &&blk_adc_imm,
+			&&blk_clrc, &&blk_setc, &&blk_nop,
+			&&blk_mov_a_dp, &&blk_mov_x_dp, &&blk_mov_y_dp, &&blk_mov_a_abs,
+			&&blk_cmp_a_dp, &&blk_cmp_a_abs, &&blk_cmp_x_dp, &&blk_cmp_y_dp,
+			&&blk_and_dp, &&blk_or_dp, &&blk_eor_dp, &&blk_adc_dp, &&blk_sbc_dp,
+			&&blk_mov_a_absx, &&blk_mov_a_absy, &&blk_mov_a_dpx, &&blk_mov_a_ix, &&blk_mov_a_idy,
+			&&blk_mov_dp_a, &&blk_mov_dp_x, &&blk_mov_dp_y, &&blk_mov_abs_a,
+			&&blk_mov_absx_a, &&blk_mov_absy_a, &&blk_mov_dpx_a, &&blk_mov_ix_a, &&blk_mov_idy_a,
+			&&blk_inc_dp, &&blk_dec_dp, &&blk_inc_abs, &&blk_dec_abs,
+			&&blk_bra, &&blk_jmp,
+			&&blk_beq, &&blk_bne, &&blk_bmi, &&blk_bpl, &&blk_bcs, &&blk_bcc, &&blk_bvs, &&blk_bvc,
+			&&blk_dbnz_y, &&blk_cbne_dp, &&blk_dbnz_dp
+		};
+		cpu_block_t* block = 0;
+		cpu_op_t const* op = 0;
+		rel_time_t block_time = 0;
+	#endif
+
+	goto loop;
+
+#if SPC_CPU_THREADED
+
+	// Threaded code
+
+#define BLOCK_OP( name )    name: rel_time = block_time + op->time;
+#define NEXT_OP()           goto *(++op)->handler
+
+// Ends block after instruction if it accessed $F0-$FF
+#define BLOCK_IO( addr )\
+	if ( (unsigned) ((uint16_t) (addr) - 0xF0) < reg_count )\
+		goto block_done;
+
+// Ends block after instruction if it also modified block's code
+#define BLOCK_WRITTEN( addr )\
+	BLOCK_IO( addr )\
+	if ( (unsigned) ((uint16_t) (addr) - block->pc) < (unsigned) block->size )\
+		goto block_done;
+
+// Conditional branches only leave block when taken. Time assumed they were.
+#define BLOCK_BRANCH( cond )\
+	if ( cond )\
+		goto block_taken;\
+	block_time -= 2;\
+	NEXT_OP();
+
+#define BLOCK_ADC( data )\
+{\
+	int flags = (data) ^ a;\
+	nz = a + (data) + (c >> 8 & 1);\
+	flags ^= nz;\
+	psw = (psw & ~(v40 | h08)) |\
+			(flags >> 1 & h08) |\
+			((flags + 0x80) >> 2 & v40);\
+	c = nz;\
+	a = (uint8_t) nz;\
+}
+
+block_loop:
+	{
+		// High accuracy always uses interpreter
+		unsigned addr = GET_PC();
+		if ( accuracy == accuracy_high || addr > 0xFFFF )
+			goto loop;
+
+		cpu_block_t* b = &cpu_blocks [(addr ^ addr >> cpu_block_bits) &
+				((1 << cpu_block_bits) - 1)];
+		if ( b->pc != (int) addr || memcmp( b->code, ram + addr, b->size ) )
+			cpu_decode_block( b, addr, block_handlers );
+		block = b;
+	}
+block_again:
+	// Only run block if it finishes before end of time slice
+	if ( !block->time || rel_time + block->time > 0 )
+		goto loop;
+
+	// Skip iterations of timer polling loop that would read zero, up to
+	// end of time slice
+	if ( block->timer >= 0 && !dp && !m.timers [block->timer].counter )
+	{
+		Timer const* t = &m.timers [block->timer];
+		int const period = block->ops [1].time; // clocks per iteration
+		int n = -rel_time / period;
+		if ( t->enabled )
+		{
+			// Output becomes nonzero when divider next reaches period
+			rel_time_t change = t->next_time +
+					TIMER_MUL( t, IF_0_THEN_256( t->period - t->divider ) - 1 );
+			rel_time_t wait = change - (rel_time + block->ops [0].time);
+			int k = 0;
+			if ( wait > 0 )
+				k = (wait + period - 1) / period;
+			if ( n > k )
+				n = k;
+		}
+		if ( n > 0 )
+		{
+			rel_time += n * period;
+			nz = 0;
+			if ( block->ops [0].handler == block_handlers [blk_mov_a_dp] )
+				a = 0;
+			else if ( block->ops [0].handler == block_handlers [blk_mov_x_dp] )
+				x = 0;
+			else
+				y = 0;
+			goto block_again;
+		}
+	}
+
+	block_time = rel_time;
+	op = block->ops;
+	#if SPC_CPU_JIT
+		if ( jit_enabled )
+		{
+			// Compile once block has run enough times
+			if ( block->runs < jit_threshold && ++block->runs == jit_threshold )
+				jit_compile( block, block_handlers );
+
+			if ( block->native )
+			{
+				jit_regs.a   = a;
+				jit_regs.x   = x;
+				jit_regs.y   = y;
+				jit_regs.nz  = nz;
+				jit_regs.c   = c;
+				jit_regs.psw = psw;
+				jit_regs.dp  = dp;
+				jit_regs.block_time = block_time;
+				int end = ((jit_func_t) block->native)( &jit_regs );
+				a   = jit_regs.a;
+				x   = jit_regs.x;
+				y   = jit_regs.y;
+				nz  = jit_regs.nz;
+				c   = jit_regs.c;
+				psw = jit_regs.psw;
+				block_time = jit_regs.block_time;
+
+				op = &block->ops [end & (jit_taken - 1)];
+				rel_time = block_time + op->time;
+				if ( end & jit_taken )
+					goto block_taken;
+				goto block_done;
+			}
+		}
+	#endif
+	goto *op->handler;
+
+block_taken:
+	// Nothing can have changed block's code if it branches to its own start
+	SET_PC( op->target );
+	if ( op->target == block->pc )
+		goto block_again;
+	goto block_loop;
+
+BLOCK_OP( blk_exit )
+block_done:
+	SET_PC( op->next );
 	goto loop;
 
+BLOCK_OP( blk_mov_a_imm ) a = nz = op->addr; NEXT_OP();
+BLOCK_OP( blk_mov_x_imm ) x = nz = op->addr; NEXT_OP();
+BLOCK_OP( blk_mov_y_imm ) y = nz = op->addr; NEXT_OP();
+BLOCK_OP( blk_mov_a_x   ) a = nz = x; NEXT_OP();
+BLOCK_OP( blk_mov_a_y   ) a = nz = y; NEXT_OP();
+BLOCK_OP( blk_mov_x_a   ) x = nz = a; NEXT_OP();
+BLOCK_OP( blk_mov_y_a   ) y = nz = a; NEXT_OP();
+
+BLOCK_OP( blk_inc_a ) nz = a + 1; a = (uint8_t) nz; NEXT_OP();
+BLOCK_OP( blk_inc_x ) nz = x + 1; x = (uint8_t) nz; NEXT_OP();
+BLOCK_OP( blk_inc_y ) nz = y + 1; y = (uint8_t) nz; NEXT_OP();
+BLOCK_OP( blk_dec_a ) nz = a - 1; a = (uint8_t) nz; NEXT_OP();
+BLOCK_OP( blk_dec_x ) nz = x - 1; x = (uint8_t) nz; NEXT_OP();
+BLOCK_OP( blk_dec_y ) nz = y - 1; y = (uint8_t) nz; NEXT_OP();
+
+BLOCK_OP( blk_cmp_a_imm ) nz = a - op->addr; c = ~nz; nz &= 0xFF; NEXT_OP();
+BLOCK_OP( blk_cmp_x_imm ) nz = x - op->addr; c = ~nz; nz &= 0xFF; NEXT_OP();
+BLOCK_OP( blk_cmp_y_imm ) nz = y - op->addr; c = ~nz; nz &= 0xFF; NEXT_OP();
+
+BLOCK_OP( blk_and_imm ) nz = a &= op->addr; NEXT_OP();
+BLOCK_OP( blk_or_imm  ) nz = a |= op->addr; NEXT_OP();
+BLOCK_OP( blk_eor_imm ) nz = a ^= op->addr; NEXT_OP();
+BLOCK_OP( blk_adc_imm ) BLOCK_ADC( op->addr ); NEXT_OP();
+
+BLOCK_OP( blk_clrc ) c = 0;  NEXT_OP();
+BLOCK_OP( blk_setc ) c = ~0; NEXT_OP();
+BLOCK_OP( blk_nop  ) NEXT_OP();
+
+BLOCK_OP( blk_mov_a_dp ) READ_DP_TIMER( 0, op->addr, a = nz ); NEXT_OP();
+BLOCK_OP( blk_mov_x_dp ) READ_DP_TIMER( 0, op->addr, x = nz ); NEXT_OP();
+BLOCK_OP( blk_mov_y_dp ) READ_DP_TIMER( 0, op->addr, y = nz ); NEXT_OP();
+BLOCK_OP( blk_mov_a_abs ) a = nz = READ( 0, op->addr ); NEXT_OP();
+
+BLOCK_OP( blk_cmp_a_dp  ) nz = a - READ_DP( 0, op->addr ); c = ~nz; nz &= 0xFF; NEXT_OP();
+BLOCK_OP( blk_cmp_a_abs ) nz = a - READ( 0, op->addr );    c = ~nz; nz &= 0xFF; NEXT_OP();
+BLOCK_OP( blk_cmp_x_dp  ) nz = x - READ_DP( 0, op->addr ); c = ~nz; nz &= 0xFF; NEXT_OP();
+BLOCK_OP( blk_cmp_y_dp  ) nz = y - READ_DP( 0, op->addr ); c = ~nz; nz &= 0xFF; NEXT_OP();
+
+BLOCK_OP( blk_and_dp ) nz = a &= READ_DP( 0, op->addr ); NEXT_OP();
+BLOCK_OP( blk_or_dp  ) nz = a |= READ_DP( 0, op->addr ); NEXT_OP();
+BLOCK_OP( blk_eor_dp ) nz = a ^= READ_DP( 0, op->addr ); NEXT_OP();
+BLOCK_OP( blk_adc_dp )
+	{
+		int data = READ_DP( 0, op->addr );
+		BLOCK_ADC( data );
+	}
+	NEXT_OP();
+BLOCK_OP( blk_sbc_dp )
+	{
+		int data = READ_DP( 0, op->addr ) ^ 0xFF;
+		BLOCK_ADC( data );
+	}
+	NEXT_OP();
+
+	{
+		int addr;
+	BLOCK_OP( blk_mov_a_absx )
+		addr = op->addr + x;
+		goto mov_a_indexed;
+	BLOCK_OP( blk_mov_a_absy )
+		addr = op->addr + y;
+		goto mov_a_indexed;
+	BLOCK_OP( blk_mov_a_dpx )
+		addr = (uint8_t) (op->addr + x) + dp;
+		goto mov_a_indexed;
+	BLOCK_OP( blk_mov_a_ix )
+		addr = x + dp;
+		goto mov_a_indexed;
+	BLOCK_OP( blk_mov_a_idy )
+		addr = READ_PROG16( op->addr + dp ) + y;
+	mov_a_indexed:
+		a = nz = READ( 0, addr );
+		BLOCK_IO( addr )
+		NEXT_OP();
+	}
+
+BLOCK_OP( blk_mov_dp_a )
+	WRITE_DP( 0, op->addr, a );
+	BLOCK_WRITTEN( dp + op->addr )
+	NEXT_OP();
+
+BLOCK_OP( blk_mov_dp_x )
+	WRITE_DP( 0, op->addr, x );
+	BLOCK_WRITTEN( dp + op->addr )
+	NEXT_OP();
+
+BLOCK_OP( blk_mov_dp_y )
+	WRITE_DP( 0, op->addr, y );
+	BLOCK_WRITTEN( dp + op->addr )
+	NEXT_OP();
+
+	{
+		int addr;
+	BLOCK_OP( blk_mov_abs_a )
+		addr = op->addr;
+		goto mov_indexed_a;
+	BLOCK_OP( blk_mov_absx_a )
+		addr = op->addr + x;
+		goto mov_indexed_a;
+	BLOCK_OP( blk_mov_absy_a )
+		addr = op->addr + y;
+		goto mov_indexed_a;
+	BLOCK_OP( blk_mov_dpx_a )
+		addr = (uint8_t) (op->addr + x) + dp;
+		goto mov_indexed_a;
+	BLOCK_OP( blk_mov_ix_a )
+		addr = x + dp;
+		goto mov_indexed_a;
+	BLOCK_OP( blk_mov_idy_a )
+		addr = READ_PROG16( op->addr + dp ) + y;
+	mov_indexed_a:
+		WRITE( 0, addr, a );
+		BLOCK_WRITTEN( addr )
+		NEXT_OP();
+	}
+
+	{
+		int addr;
+	BLOCK_OP( blk_inc_dp )
+		addr = op->addr + dp;
+		goto inc_addr;
+	BLOCK_OP( blk_dec_dp )
+		addr = op->addr + dp;
+		goto dec_addr;
+	BLOCK_OP( blk_inc_abs )
+		addr = op->addr;
+	inc_addr:
+		nz = READ( -1, addr ) + 1;
+		goto inc_dec_addr;
+	BLOCK_OP( blk_dec_abs )
+		addr = op->addr;
+	dec_addr:
+		nz = READ( -1, addr ) - 1;
+	inc_dec_addr:
+		WRITE( 0, addr, /*(uint8_t)*/ nz );
+		BLOCK_WRITTEN( addr )
+		NEXT_OP();
+	}
+
+BLOCK_OP( blk_bra ) goto block_taken;
+BLOCK_OP( blk_jmp ) goto block_taken;
+BLOCK_OP( blk_beq ) BLOCK_BRANCH( !(uint8_t) nz )
+BLOCK_OP( blk_bne ) BLOCK_BRANCH( (uint8_t) nz )
+BLOCK_OP( blk_bmi ) BLOCK_BRANCH( (nz & nz_neg_mask) )
+BLOCK_OP( blk_bpl ) BLOCK_BRANCH( !(nz & nz_neg_mask) )
+BLOCK_OP( blk_bcs ) BLOCK_BRANCH( c & 0x100 )
+BLOCK_OP( blk_bcc ) BLOCK_BRANCH( !(c & 0x100) )
+BLOCK_OP( blk_bvs ) BLOCK_BRANCH( psw & v40 )
+BLOCK_OP( blk_bvc ) BLOCK_BRANCH( !(psw & v40) )
+
+BLOCK_OP( blk_dbnz_y )
+	y = (uint8_t) (y - 1);
+	BLOCK_BRANCH( y )
+
+BLOCK_OP( blk_cbne_dp )
+	{
+		int temp;
+		READ_DP_TIMER( -4, op->addr, temp );
+		BLOCK_BRANCH( temp != a )
+	}
+
+BLOCK_OP( blk_dbnz_dp )
+	{
+		unsigned temp = READ_DP( -4, op->addr ) - 1;
+		WRITE_DP( -3, op->addr, /*(uint8_t)*/ temp + no_read_before_write );
+		if ( (unsigned) (dp + op->addr - block->pc) < (unsigned) block->size )
+		{
+			// Modified block's code
+			SET_PC( op->target );
+			if ( !temp )
+			{
+				SET_PC( op->next );
+				rel_time -= 2;
+			}
+			goto loop;
+		}
+		BLOCK_BRANCH( temp )
+	}
+
+#endif
+
 
 	// Main loop
 
 cbranch_taken_loop:
 	pc += *(int8_t const*) pc;
+	#if SPC_CPU_THREADED
+		pc++;
+		goto block_loop;
+	#endif
 inc_pc_loop:
 	pc++;
+#if !SPC_CPU_THREADED
+block_loop: // taken branches
+#endif
 loop:
 {
 	unsigned opcode;
@@ -662,20 +1213,24 @@ loop:
 	#ifdef SPC_CPU_OPCODE_HOOK
 		SPC_CPU_OPCODE_HOOK( GET_PC(), opcode );
 	#endif
-	/*
-	//SUB_CASE_COUNTER( 1 );
-	#define PROFILE_TIMER_LOOP( op, addr, len )\
-	if ( opcode == op )\
-	{\
-		int cond = (unsigned) ((addr) - 0xFD) < 3 &&\
-				pc [len] == 0xF0 && pc [len+1] == 0xFE - len;\
-		SUB_CASE_COUNTER( op && cond );\
-	}
 
-	PROFILE_TIMER_LOOP( 0xEC, GET_LE16( pc + 1 ), 3 );
-	PROFILE_TIMER_LOOP( 0xEB, pc [1], 2 );
-	PROFILE_TIMER_LOOP( 0xE4, pc [1], 2 );
-	*/
+	#if SPC_CPU_PROFILE
+		cpu_profiler.opcode( opcode, rel_time - m.cycle_table [opcode] );
+
+		// Counts polling of timer output in a tight loop,
+		// i.e. MOV A,$FD / BEQ back to MOV
+		#define PROFILE_TIMER_LOOP( op, addr, len )\
+		if ( opcode == op )\
+		{\
+			int cond = (unsigned) ((addr) - 0xFD) < 3 &&\
+					pc [len] == 0xF0 && pc [len+1] == 0xFE - len;\
+			cpu_profiler.timer_loops += cond;\
+		}
+
+		PROFILE_TIMER_LOOP( 0xEC, READ_PC16( pc + 1 ), 3 );
+		PROFILE_TIMER_LOOP( 0xEB, pc [1], 2 );
+		PROFILE_TIMER_LOOP( 0xE4, pc [1], 2 );
+	#endif
 
 	// TODO: if PC is at end of memory, this will get wrong operand (very obscure)
 	data = *++pc;
@@ -689,7 +1244,7 @@ loop:
 	pc++;\
 	pc += (int8_t) data;\
 	if ( cond )\
-		goto loop;\
+		goto block_loop;\
 	pc -= (int8_t) data;\
 	rel_time -= 2;\
 	goto loop;\
@@ -744,7 +1299,7 @@ loop:
 		int temp = READ_PC( pc + 1 );
 		pc += 2;
 
-		#if !SPC_MORE_ACCURACY
+		if ( accuracy != accuracy_high )
 		{
 			int i = dp + temp;
 			ram [i] = (uint8_t) data;
@@ -759,15 +1314,16 @@ loop:
 					cpu_write_smp_reg( data, rel_time, i );
 			}
 		}
-		#else
+		else
+		{
 			WRITE_DP( 0, temp, data );
-		#endif
+		}
 		goto loop;
 	}
 
 	case 0xC4: // MOV dp,a
 		++pc;
-		#if !SPC_MORE_ACCURACY
+		if ( accuracy != accuracy_high )
 		{
 			int i = dp + data;
 			ram [i] = (uint8_t) a;
@@ -783,9 +1339,10 @@ loop:
 					cpu_write_smp_reg_( a, rel_time, i );
 			}
 		}
-		#else
+		else
+		{
 			WRITE_DP( 0, data, a );
-		#endif
+		}
 		goto loop;
 
 #define CASE( n )   case n:
@@ -1337,8 +1894,8 @@ loop:
 // 12. BRANCHING COMMANDS
 
 	case 0x2F: // BRA rel
-		pc += (int8_t) data;
-		goto inc_pc_loop;
+		pc += (int8_t) data + 1;
+		goto block_loop;
 
 	case 0x30: // BMI
 		BRANCH( (nz & nz_neg_mask) )
@@ -1412,7 +1969,7 @@ loop:
 		// fall through
 	case 0x5F: // JMP abs
 		SET_PC( READ_PC16( pc ) );
-		goto loop;
+		goto block_loop;
 
 // 13. SUB-ROUTINE CALL RETURN COMMANDS
 
@@ -1662,6 +2219,9 @@ loop:
 out_of_time:
 	rel_time -= m.cycle_table [*pc]; // undo partial execution of opcode
 stop:
+	#if SPC_CPU_PROFILE
+		cpu_profiler.stop( rel_time );
+	#endif
 
 	// Uncache registers
 	if ( GET_PC() >= 0x10000 )
@@ -1679,3 +2239,14 @@ stop:
 }
 SPC_CPU_RUN_FUNC_END
 
+// Fast accuracy differs from normal only in how DSP is caught up, so both use
+// the same CPU core
+template uint8_t* SNES_SPC::run_cpu<SNES_SPC::accuracy_high  >( time_t );
+template uint8_t* SNES_SPC::run_cpu<SNES_SPC::accuracy_normal>( time_t );
+
+uint8_t* SNES_SPC::run_until_( time_t end_time )
+{
+	if ( m.accuracy == accuracy_high )
+		return run_cpu<accuracy_high>( end_time );
+	return run_cpu<accuracy_normal>( end_time );
+}
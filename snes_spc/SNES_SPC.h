@@ -6,9 +6,37 @@
 
 #include "spc_common.h"
 #include "SPC_DSP.h"
+#include "SPC_Resampler.h"
 #include <cstdint>
 #include <climits>
 
+#if SPC_CPU_PROFILE
+	#include "SPC_Profiler.h"
+#endif
+
+// Hot loops in SPC-700 code are predecoded and run as threaded code, using
+// GCC's computed goto. Can't be used with opcode hook or profiling, which see
+// every instruction.
+#ifndef SPC_CPU_THREADED
+	#if defined (__GNUC__) && !SPC_CPU_PROFILE && \
+			!defined (SPC_CPU_OPCODE_HOOK)
+		#define SPC_CPU_THREADED 1
+	#else
+		#define SPC_CPU_THREADED 0
+	#endif
+#endif
+
+// Frequently run blocks of threaded code can be compiled to native x86-64 code
+// once enabled with enable_jit(). Define SPC_CPU_JIT=0 to leave it out.
+#ifndef SPC_CPU_JIT
+	#if SPC_CPU_THREADED && defined (__x86_64__) && \
+			(defined (__linux__) || defined (__APPLE__))
+		#define SPC_CPU_JIT 1
+	#else
+		#define SPC_CPU_JIT 0
+	#endif
+#endif
+
 typedef const char* blargg_err_t;
 
 struct SNES_SPC {
@@ -31,6 +59,11 @@ public:
 	typedef short sample_t;
 	void set_output( sample_t* out, int out_size );
 
+	// Sets destination for output samples in another format, optionally with
+	// left and right channels in separate buffers. See SPC_DSP.h.
+	typedef SPC_DSP::sample_format_t sample_format_t;
+	void set_output( sample_format_t, void* left, void* right, int out_size );
+
 	// Number of samples written to output since last set
 	int sample_count() const;
 
@@ -62,14 +95,38 @@ public:
 	enum { voice_count = 8 };
 	void mute_voices( int mask );
 
-	// If true, prevents channels and global volumes from being phase-negated.
-	// Only supported by fast DSP.
+	// If true, prevents channels and global volumes from being phase-negated
 	void disable_surround( bool disable = true );
 
+	// Selects DSP emulation engine. Fast engine is only accurate to the sample
+	// and skips work for silent voices. See SPC_DSP.h.
+	typedef SPC_DSP::engine_t dsp_engine_t;
+	void set_dsp_engine( dsp_engine_t e )   { dsp.set_engine( e ); }
+
+	// Has DSP share decoded BRR blocks through cache, which can be used by many
+	// emulators at once. See SPC_BRR_Cache.h.
+	void set_brr_cache( SPC_BRR_Cache* c )  { dsp.set_brr_cache( c ); }
+
+	// Filters output as it's generated, instead of calling filter->run() on it
+	// after play(). See SPC_DSP::set_filter().
+	void set_filter( SPC_Filter* f )        { dsp.set_filter( f ); }
+
 	// Sets tempo, where tempo_unit = normal, tempo_unit / 2 = half speed, etc.
+	// Has no effect when compiled with SPC_DISABLE_TEMPO=1, which makes timers
+	// use shifts rather than divides.
 	enum { tempo_unit = 0x100 };
 	void set_tempo( int );
 
+	// Sets trade-off between accuracy and speed. Normal is right for nearly
+	// all music. High runs every instruction in the interpreter and is mainly
+	// for validation tests that access the echo buffer in odd ways. Fast runs
+	// DSP in whole samples only, and lets skip() jump over long spans without
+	// running DSP. Takes effect at next reset(), soft_reset() or load_spc().
+	// Default is normal, or as set by SPC_MORE_ACCURACY=1 or SPC_LESS_ACCURATE=1.
+	enum accuracy_t { accuracy_high, accuracy_normal, accuracy_fast };
+	void set_accuracy( accuracy_t a )       { m.new_accuracy = a; }
+	accuracy_t accuracy() const             { return m.accuracy; }
+
 // SPC music files
 
 	// Loads SPC data into emulator
@@ -84,11 +141,44 @@ public:
 	// is NULL. Count must be a multiple of 2 since output is stereo.
 	blargg_err_t play( int count, sample_t* out );
 
-	// Skips count samples. Several times faster than play() when using fast DSP.
+	// Same as play(), but writes samples in given format. If right isn't NULL,
+	// count / 2 samples of left and right channels are written to separate
+	// buffers.
+	blargg_err_t play( int count, sample_format_t, void* left, void* right = NULL );
+
+	// Plays for count samples at another sample rate and writes them to out.
+	// Samples are resampled with a band-limited filter that keeps its phase
+	// between calls, so output can be streamed in blocks of any size. Count
+	// must be a multiple of 2. Resampler is allocated on first call.
+	blargg_err_t play_resampled( int count, sample_t* out, int rate );
+
+	// Same as play(), but also writes each voice's output alone to stems, count
+	// samples per voice. echo_buf of stem_echo_size bytes holds the voices'
+	// echoes and must be kept between calls. See SPC_DSP::set_stems().
+	enum { stem_echo_size = SPC_DSP::stem_echo_size };
+	blargg_err_t play_stems( int count, sample_t* out, sample_t* stems, void* echo_buf );
+
+	// Skips count samples, leaving the same state as play() with a NULL buffer
+	// (except with accuracy_fast, see set_accuracy()). Faster since the DSP
+	// doesn't generate output for them.
 	blargg_err_t skip( int count );
 
+	// Enables compiling of SPC-700 code to native code. Disabled by default.
+	// Results are the same either way. Has no effect where SPC_CPU_JIT isn't
+	// supported or is defined to 0.
+	void enable_jit( bool enable = true );
+
 // State save/load (only available with accurate DSP)
 
+	// Saves/loads exact emulator state as raw_size bytes, with one copy each
+	// for SPC and DSP. Faster than copy_state(), so snapshots can be taken
+	// every frame for rewind or run-ahead. Data is only valid for the
+	// same build of the library, so keep it in memory rather than in files.
+	// Works with either DSP engine. Output buffer isn't saved, so call
+	// set_output() after load_raw().
+	void save_raw( void* out ) const;
+	void load_raw( void const* in );
+
 #if !SPC_NO_COPY_STATE_FUNCS
 	// Saves/loads state
 	enum { state_size = 67 * 1024L }; // maximum space needed when saving
@@ -107,7 +197,19 @@ public:
 	bool check_kon();
 #endif
 
+#if SPC_CPU_PROFILE
+	// Opcode profile collected since init(), when compiled with SPC_CPU_PROFILE=1
+	SPC_CPU_Profiler& cpu_profile() { return cpu_profiler; }
+#endif
+
+#if SPC_DSP_PROFILE
+	// DSP host time profile collected since init(), when compiled with SPC_DSP_PROFILE=1
+	SPC_DSP_Profiler& dsp_profile() { return dsp.profile(); }
+#endif
+
 public:
+	SNES_SPC();
+	~SNES_SPC();
 
 	// Time relative to m_spc_time. Speeds up code a bit by eliminating need to
 	// constantly add m_spc_time to time from CPU. CPU uses time that ends at
@@ -131,12 +233,103 @@ public:
 
 private:
 	SPC_DSP dsp;
+	SPC_Resampler* resampler; // NULL until play_resampled() is first used
 
-	#if SPC_LESS_ACCURATE
-		static signed char const reg_times_ [256];
-		signed char reg_times [256];
+	// Owns resampler and executable memory, so can't be copied
+	SNES_SPC( const SNES_SPC& );
+	SNES_SPC& operator = ( const SNES_SPC& );
+
+	#if SPC_CPU_PROFILE
+		SPC_CPU_Profiler cpu_profiler;
+	#endif
+
+	#if SPC_CPU_THREADED
+		// Predecoded instructions, in same order as handler table in run_until_()
+		enum {
+			blk_exit,
+			blk_mov_a_imm, blk_mov_x_imm, blk_mov_y_imm,
+			blk_mov_a_x, blk_mov_a_y, blk_mov_x_a, blk_mov_y_a,
+			blk_inc_a, blk_inc_x, blk_inc_y, blk_dec_a, blk_dec_x, blk_dec_y,
+			blk_cmp_a_imm, blk_cmp_x_imm, blk_cmp_y_imm,
+			blk_and_imm, blk_or_imm, blk_eor_imm, blk_adc_imm,
+			blk_clrc, blk_setc, blk_nop,
+			blk_mov_a_dp, blk_mov_x_dp, blk_mov_y_dp, blk_mov_a_abs,
+			blk_cmp_a_dp, blk_cmp_a_abs, blk_cmp_x_dp, blk_cmp_y_dp,
+			blk_and_dp, blk_or_dp, blk_eor_dp, blk_adc_dp, blk_sbc_dp,
+			blk_mov_a_absx, blk_mov_a_absy, blk_mov_a_dpx, blk_mov_a_ix, blk_mov_a_idy,
+			blk_mov_dp_a, blk_mov_dp_x, blk_mov_dp_y, blk_mov_abs_a,
+			blk_mov_absx_a, blk_mov_absy_a, blk_mov_dpx_a, blk_mov_ix_a, blk_mov_idy_a,
+			blk_inc_dp, blk_dec_dp, blk_inc_abs, blk_dec_abs,
+			blk_bra, blk_jmp,
+			blk_beq, blk_bne, blk_bmi, blk_bpl, blk_bcs, blk_bcc, blk_bvs, blk_bvc,
+			blk_dbnz_y, blk_cbne_dp, blk_dbnz_dp,
+			blk_handler_count
+		};
+
+		struct cpu_op_t
+		{
+			void*    handler;
+			uint16_t time;   // clocks from start of block to end of instruction
+			uint16_t addr;   // immediate operand or address
+			uint16_t next;   // address of following instruction
+			uint16_t target; // branch target
+		};
+
+		// Straight-line code starting at a branch target, which can be run
+		// without checking for end of time slice after each instruction.
+		// Code is compared with RAM before running block, since the stack and
+		// DSP echo write to RAM without going through cpu_write().
+		enum { cpu_block_ops = 16 };
+		struct cpu_block_t
+		{
+			int      pc;    // -1 if unused
+			int      size;  // bytes of code
+			int      time;  // clocks if all instructions run and branches are taken
+			cpu_op_t ops  [cpu_block_ops + 1];
+			uint8_t  code [cpu_block_ops * 3];
+			int      timer; // timer polled by MOV reg,dp / BEQ loop, or -1
+		#if SPC_CPU_JIT
+			void*    native; // compiled code, or NULL
+			int      runs;   // times run before being compiled
+		#endif
+		};
+		enum { cpu_block_bits = 8 };
+		cpu_block_t cpu_blocks [1 << cpu_block_bits];
+
+		void cpu_decode_block( cpu_block_t*, int addr, void* const handlers [] );
 	#endif
 
+	#if SPC_CPU_JIT
+		// CPU registers passed to and from compiled code
+		struct jit_regs_t
+		{
+			SNES_SPC* spc;
+			uint8_t*  ram;
+			int a, x, y, nz, c, psw, dp;
+			rel_time_t block_time;
+		};
+		jit_regs_t jit_regs;
+
+		// Compiled code returns index of instruction it ended at, plus
+		// jit_taken if that was a taken branch
+		typedef int (*jit_func_t)( jit_regs_t* );
+		enum { jit_taken = 0x100 };
+		enum { jit_threshold = 16 };
+		enum { jit_code_size = 512 * 1024L };
+
+		bool     jit_enabled;
+		uint8_t* jit_code; // executable memory, allocated when first needed
+		long     jit_used;
+
+		void jit_free();
+		bool jit_compile( cpu_block_t*, void* const handlers [] );
+		static int  jit_read ( SNES_SPC*, int addr, rel_time_t );
+		static void jit_write( SNES_SPC*, int data, int addr, rel_time_t );
+	#endif
+
+	static signed char const reg_times_ [256];
+	signed char reg_times [256];
+
 	struct state_t
 	{
 		Timer timers [timer_count];
@@ -157,22 +350,17 @@ private:
 		time_t      spc_time;
 		bool        echo_accessed;
 
-		int         tempo;
+		accuracy_t  accuracy;
 		int         skipped_kon;
 		int         skipped_koff;
-		const char* cpu_error;
 
 		int         extra_clocks;
-		sample_t*   buf_begin;
-		sample_t const* buf_end;
-		sample_t*   extra_pos;
+		int         extra_count; // samples in extra_buf
 		sample_t    extra_buf [extra_size];
 
 		int         rom_enabled;
-		uint8_t     rom    [rom_size];
 		uint8_t     hi_ram [rom_size];
-
-		unsigned char cycle_table [256];
+		uint8_t     pages  [0x100]; // page_ flags for each 256 bytes of memory
 
 		struct
 		{
@@ -184,9 +372,23 @@ private:
 			uint8_t ram      [0x10000];
 			uint8_t padding2 [0x100];
 		} ram;
+
+		// settings and non-emulation state, not saved by save_raw()
+		int         tempo;
+		accuracy_t  new_accuracy;
+		const char* cpu_error;
+		bool        has_output;
+		uint8_t     rom    [rom_size];
+
+		unsigned char cycle_table [256];
 	};
 	state_t m;
 
+public:
+	// Number of bytes save_raw() writes
+	enum { raw_size = offsetof (state_t,tempo) + SPC_DSP::raw_size };
+
+private:
 	enum { rom_addr = 0xFFC0 };
 
 	enum { skipping_time = 127 };
@@ -214,6 +416,15 @@ private:
 	void reset_time_regs();
 	void reset_common( int timer_counter_init );
 
+	// Flags for each 256-byte page of memory. Accesses to pages without the
+	// relevant flag are to plain RAM.
+	enum {
+		page_io   = 0x01, // $F0-$FF registers, and where addresses wrap around
+		page_rom  = 0x02, // IPL ROM at $FFC0, while enabled
+		page_echo = 0x04  // echo buffer, while DSP writes to it
+	};
+	void update_pages();
+
 	Timer* run_timer_      ( Timer* t, rel_time_t );
 	Timer* run_timer       ( Timer* t, rel_time_t );
 	int dsp_read           ( rel_time_t );
@@ -228,6 +439,8 @@ private:
 
 	bool check_echo_access ( int addr );
 	uint8_t* run_until_( time_t end_time );
+	template<int accuracy>
+	uint8_t* run_cpu( time_t end_time );
 
 	struct spc_file_t
 	{
@@ -272,6 +485,15 @@ inline void SNES_SPC::mute_voices( int mask ) { dsp.mute_voices( mask ); }
 
 inline void SNES_SPC::disable_surround( bool disable ) { dsp.disable_surround( disable ); }
 
+inline void SNES_SPC::enable_jit( bool enable )
+{
+	#if SPC_CPU_JIT
+		jit_enabled = enable;
+	#else
+		(void) enable;
+	#endif
+}
+
 #if !SPC_NO_COPY_STATE_FUNCS
 inline bool SNES_SPC::check_kon() { return dsp.check_kon(); }
 #endif
@@ -0,0 +1,662 @@
+// Compiles SPC-700 threaded code blocks to native x86-64 code
+
+// snes_spc 0.9.0. http://www.slack.net/~ant/
+
+#include "SNES_SPC.h"
+
+#if SPC_CPU_JIT
+
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+
+/* Copyright (C) 2026 agent <agent@local>. This module is free software; you
+can redistribute it and/or modify it under the terms of the GNU Lesser
+General Public License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version. This
+module is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+details. You should have received a copy of the GNU Lesser General Public
+License along with this module; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA */
+
+// Compiled code does exactly what the threaded code handlers in run_until_()
+// do, with the same times for memory accesses. Accesses to $F0-$FF and
+// high memory go through cpu_read() and cpu_write(), and plain RAM is
+// accessed directly. Anything unusual ends the block, which is always safe
+// since the interpreter then continues at the following instruction.
+
+void SNES_SPC::jit_free()
+{
+	if ( jit_code )
+		munmap( jit_code, jit_code_size );
+	jit_code = 0;
+}
+
+int SNES_SPC::jit_read( SNES_SPC* spc, int addr, rel_time_t time )
+{
+	return spc->cpu_read( addr, time );
+}
+
+void SNES_SPC::jit_write( SNES_SPC* spc, int data, int addr, rel_time_t time )
+{
+	spc->cpu_write( data, addr, time );
+}
+
+
+//// x86-64 code generation
+
+enum { rax, rcx, rdx, rbx, rsp, rbp, rsi, rdi, r8, r9, r10, r11, r12, r13, r14, r15 };
+
+// SPC-700 registers are kept in registers preserved across calls
+int const reg_regs = rbx; // jit_regs_t*
+int const reg_ram  = r12;
+int const reg_a    = r13;
+int const reg_x    = r14;
+int const reg_y    = r15;
+int const reg_nz   = rbp;
+
+int const nz_neg_mask = 0x880; // either bit set indicates N flag set
+
+// Condition codes
+enum { cc_b = 2, cc_ae = 3, cc_z = 4, cc_nz = 5, cc_be = 6, cc_a = 7, cc_g = 0xF };
+
+// ALU operations, as /digit of opcode 0x81 and with opcode (n << 3 | 1) for
+// register source
+enum { alu_add = 0, alu_or = 1, alu_and = 4, alu_sub = 5, alu_xor = 6, alu_cmp = 7 };
+
+int const no_index = -1;
+
+struct Jit_Asm
+{
+	uint8_t* pos;
+
+	void byte ( int n ) { *pos++ = (uint8_t) n; }
+	void dword( int n ) { set_le32( pos, n ); pos += 4; }
+
+	// REX prefix. Force is for byte registers SPL, BPL, SIL and DIL.
+	void rex( int w, int reg, int index, int base, bool force = false )
+	{
+		int r = 0x40 | w << 3 | (reg >> 3 & 1) << 2 | (index >> 3 & 1) << 1 | (base >> 3 & 1);
+		if ( r != 0x40 || force )
+			byte( r );
+	}
+
+	void opcode( int op )
+	{
+		if ( op > 0xFF )
+			byte( op >> 8 );
+		byte( op );
+	}
+
+	// op reg, rm
+	void rr( int op, int reg, int rm, int w = 0, bool byte_regs = false )
+	{
+		rex( w, reg, 0, rm, byte_regs );
+		opcode( op );
+		byte( 0xC0 | (reg & 7) << 3 | (rm & 7) );
+	}
+
+	// op reg, [base + index + disp]
+	void rm( int op, int reg, int base, int index, int disp, int w = 0, bool byte_regs = false )
+	{
+		rex( w, reg, (index < 0 ? 0 : index), base, byte_regs );
+		opcode( op );
+		if ( index < 0 && (base & 7) != rsp )
+		{
+			byte( 0x80 | (reg & 7) << 3 | (base & 7) );
+		}
+		else
+		{
+			byte( 0x80 | (reg & 7) << 3 | 4 );
+			byte( ((index < 0 ? rsp : index) & 7) << 3 | (base & 7) );
+		}
+		dword( disp );
+	}
+
+	// Field of jit_regs_t
+	void load ( int reg, int offset ) { rm( 0x8B, reg, reg_regs, no_index, offset ); }
+	void store( int reg, int offset ) { rm( 0x89, reg, reg_regs, no_index, offset ); }
+
+	void mov ( int dst, int src )   { rr( 0x89, src, dst ); }
+	void alu ( int op, int dst, int src ) { rr( op << 3 | 1, src, dst ); }
+	void test( int a, int b )       { rr( 0x85, b, a ); }
+
+	void mov_imm( int dst, int n )
+	{
+		rex( 0, 0, 0, dst );
+		byte( 0xB8 + (dst & 7) );
+		dword( n );
+	}
+
+	void alu_imm( int op, int dst, int n )
+	{
+		rex( 0, 0, 0, dst );
+		byte( 0x81 );
+		byte( 0xC0 | op << 3 | (dst & 7) );
+		dword( n );
+	}
+
+	void alu_mem_imm( int op, int offset, int n )
+	{
+		rm( 0x81, op, reg_regs, no_index, offset );
+		dword( n );
+	}
+
+	void test_imm( int a, int n )
+	{
+		rex( 0, 0, 0, a );
+		byte( 0xF7 );
+		byte( 0xC0 | (a & 7) );
+		dword( n );
+	}
+
+	void test_mem_imm( int offset, int n )
+	{
+		rm( 0xF7, 0, reg_regs, no_index, offset );
+		dword( n );
+	}
+
+	void store_imm( int offset, int n )
+	{
+		rm( 0xC7, 0, reg_regs, no_index, offset );
+		dword( n );
+	}
+
+	void shr( int dst, int n )      { rex( 0, 0, 0, dst ); byte( 0xC1 ); byte( 0xE8 | (dst & 7) ); byte( n ); }
+	void not_( int dst )            { rex( 0, 0, 0, dst ); byte( 0xF7 ); byte( 0xD0 | (dst & 7) ); }
+	void zero_extend8( int dst, int src ) { rr( 0x0FB6, dst, src, 0, true ); }
+	void test8( int a )             { rr( 0x84, a, a, 0, true ); }
+
+	// RAM access at [ram + index + disp]
+	void load8  ( int dst, int index, int disp ) { rm( 0x0FB6, dst, reg_ram, index, disp ); }
+	void load16 ( int dst, int index, int disp ) { rm( 0x0FB7, dst, reg_ram, index, disp ); }
+	void store8 ( int src, int index, int disp ) { rm( 0x88, src, reg_ram, index, disp, 0, true ); }
+
+	void call( void const* func )
+	{
+		byte( 0x48 ); // mov rax,imm64
+		byte( 0xB8 );
+		uint64_t n = (uint64_t) (uintptr_t) func;
+		dword( (int) (uint32_t) n );
+		dword( (int) (uint32_t) (n >> 32) );
+		byte( 0xFF ); // call rax
+		byte( 0xD0 );
+	}
+
+	void push( int r ) { rex( 0, 0, 0, r ); byte( 0x50 + (r & 7) ); }
+	void pop ( int r ) { rex( 0, 0, 0, r ); byte( 0x58 + (r & 7) ); }
+
+	void jmp( uint8_t const* to )
+	{
+		byte( 0xE9 );
+		dword( (int) (to - (pos + 4)) );
+	}
+
+	void jcc( int cc, uint8_t const* to )
+	{
+		byte( 0x0F );
+		byte( 0x80 + cc );
+		dword( (int) (to - (pos + 4)) );
+	}
+
+	// Forward jumps return location to patch with here()
+	uint8_t* jmp_fwd()          { byte( 0xE9 ); pos += 4; return pos; }
+	uint8_t* jcc_fwd( int cc )  { byte( 0x0F ); byte( 0x80 + cc ); pos += 4; return pos; }
+	void here( uint8_t* from )  { set_le32( from - 4, (int) (pos - from) ); }
+};
+
+bool SNES_SPC::jit_compile( cpu_block_t* b, void* const handlers [] )
+{
+	// Writes to own code must end block, so such blocks aren't compiled
+	#define WRITES_CODE( addr ) ((unsigned) ((addr) - b->pc) < (unsigned) b->size)
+
+	int count = 0;
+	int kinds [cpu_block_ops + 1];
+	for ( ;; count++ )
+	{
+		cpu_op_t const& op = b->ops [count];
+		int kind = 0;
+		while ( handlers [kind] != op.handler )
+			kind++;
+		kinds [count] = kind;
+
+		switch ( kind )
+		{
+		case blk_mov_dp_a:
+		case blk_mov_dp_x:
+		case blk_mov_dp_y:
+		case blk_inc_dp:
+		case blk_dec_dp:
+		case blk_dbnz_dp:
+			if ( WRITES_CODE( op.addr ) || WRITES_CODE( op.addr + 0x100 ) )
+				return false;
+			break;
+
+		case blk_mov_abs_a:
+		case blk_inc_abs:
+		case blk_dec_abs:
+			if ( WRITES_CODE( op.addr ) || op.addr >= rom_addr )
+				return false;
+			break;
+		}
+
+		if ( kind == blk_exit || kind == blk_bra || kind == blk_jmp )
+			break;
+	}
+
+	// Allocate memory, or start over when it's full
+	enum { max_block_code = 4096 };
+	if ( !jit_code )
+	{
+		void* p = mmap( 0, jit_code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0 );
+		if ( p == MAP_FAILED )
+		{
+			jit_enabled = false;
+			return false;
+		}
+		jit_code = (uint8_t*) p;
+		jit_used = 0;
+	}
+	else
+	{
+		if ( jit_used + max_block_code > jit_code_size )
+		{
+			jit_used = 0;
+			for ( int i = 0; i < (1 << cpu_block_bits); i++ )
+			{
+				cpu_blocks [i].native = 0;
+				cpu_blocks [i].runs   = 0;
+			}
+		}
+		if ( mprotect( jit_code, jit_code_size, PROT_READ | PROT_WRITE ) )
+		{
+			jit_enabled = false;
+			return false;
+		}
+	}
+
+	#define REGS_OFFSET( field ) ((int) offsetof (jit_regs_t, field))
+	int const off_a    = REGS_OFFSET( a );
+	int const off_x    = REGS_OFFSET( x );
+	int const off_y    = REGS_OFFSET( y );
+	int const off_nz   = REGS_OFFSET( nz );
+	int const off_c    = REGS_OFFSET( c );
+	int const off_psw  = REGS_OFFSET( psw );
+	int const off_dp   = REGS_OFFSET( dp );
+	int const off_time = REGS_OFFSET( block_time );
+
+	Jit_Asm as;
+	as.pos = jit_code + jit_used;
+
+	// Exit, returning eax
+	uint8_t* const epilogue = as.pos;
+	as.store( reg_a,  off_a );
+	as.store( reg_x,  off_x );
+	as.store( reg_y,  off_y );
+	as.store( reg_nz, off_nz );
+	as.rr( 0x83, 0, rsp, 1 ); // add rsp,8
+	as.byte( 8 );
+	as.pop( r15 );
+	as.pop( r14 );
+	as.pop( r13 );
+	as.pop( r12 );
+	as.pop( rbp );
+	as.pop( rbx );
+	as.byte( 0xC3 ); // ret
+
+	// Entry
+	uint8_t* const entry = as.pos;
+	as.push( rbx );
+	as.push( rbp );
+	as.push( r12 );
+	as.push( r13 );
+	as.push( r14 );
+	as.push( r15 );
+	as.rr( 0x83, 5, rsp, 1 ); // sub rsp,8 to align stack for calls
+	as.byte( 8 );
+	as.rr( 0x89, rdi, reg_regs, 1 );
+	as.rm( 0x8B, reg_ram, reg_regs, no_index, REGS_OFFSET( ram ), 1 );
+	as.load( reg_a,  off_a );
+	as.load( reg_x,  off_x );
+	as.load( reg_y,  off_y );
+	as.load( reg_nz, off_nz );
+	uint8_t* const start = as.pos;
+
+	for ( int i = 0; i <= count; i++ )
+	{
+		cpu_op_t const& op = b->ops [i];
+		int const kind = kinds [i];
+
+		// Loads time of instruction plus offset
+		#define LOAD_TIME( reg, offset ) {\
+			as.load( reg, off_time );\
+			as.alu_imm( alu_add, reg, op.time + (offset) );\
+		}
+
+		// Ends block after instruction
+		#define EXIT( code ) {\
+			as.mov_imm( rax, (code) );\
+			as.jmp( epilogue );\
+		}
+
+		// Reads dp + op.addr into eax. Only $F0-$FF needs cpu_read().
+		#define READ_DP( offset ) {\
+			as.load( rsi, off_dp );\
+			if ( op.addr < 0xF0 ) {\
+				as.load8( rax, rsi, op.addr );\
+			} else {\
+				as.alu_imm( alu_add, rsi, op.addr );\
+				LOAD_TIME( rdx, offset );\
+				as.rm( 0x8B, rdi, reg_regs, no_index, REGS_OFFSET( spc ), 1 );\
+				as.call( (void const*) &jit_read );\
+			}\
+		}
+
+		#define READ_ABS() {\
+			if ( (unsigned) (op.addr - 0xF0) >= reg_count ) {\
+				as.load8( rax, no_index, op.addr );\
+			} else {\
+				as.mov_imm( rsi, op.addr );\
+				LOAD_TIME( rdx, 0 );\
+				as.rm( 0x8B, rdi, reg_regs, no_index, REGS_OFFSET( spc ), 1 );\
+				as.call( (void const*) &jit_read );\
+			}\
+		}
+
+		// nz = reg - eax, with carry
+		#define CMP( reg ) {\
+			as.mov( reg_nz, reg );\
+			as.alu( alu_sub, reg_nz, rax );\
+			as.mov( rcx, reg_nz );\
+			as.not_( rcx );\
+			as.store( rcx, off_c );\
+			as.alu_imm( alu_and, reg_nz, 0xFF );\
+		}
+
+		// a += eax + carry
+		#define ADC() {\
+			as.mov( rcx, rax );\
+			as.alu( alu_xor, rcx, reg_a );\
+			as.load( rdx, off_c );\
+			as.shr( rdx, 8 );\
+			as.alu_imm( alu_and, rdx, 1 );\
+			as.mov( reg_nz, reg_a );\
+			as.alu( alu_add, reg_nz, rax );\
+			as.alu( alu_add, reg_nz, rdx );\
+			as.alu( alu_xor, rcx, reg_nz );\
+			as.mov( rdx, rcx );\
+			as.shr( rdx, 1 );\
+			as.alu_imm( alu_and, rdx, 0x08 );\
+			as.alu_imm( alu_add, rcx, 0x80 );\
+			as.shr( rcx, 2 );\
+			as.alu_imm( alu_and, rcx, 0x40 );\
+			as.alu( alu_or, rcx, rdx );\
+			as.load( rdx, off_psw );\
+			as.alu_imm( alu_and, rdx, ~0x48 );\
+			as.alu( alu_or, rdx, rcx );\
+			as.store( rdx, off_psw );\
+			as.store( reg_nz, off_c );\
+			as.zero_extend8( reg_a, reg_nz );\
+		}
+
+		#define INC_DEC_REG( reg, op ) {\
+			as.mov( reg_nz, reg );\
+			as.alu_imm( op, reg_nz, 1 );\
+			as.zero_extend8( reg, reg_nz );\
+		}
+
+		uint8_t* skip = 0;
+		int cond = -1; // condition for branch to be taken
+		switch ( kind )
+		{
+		case blk_exit:
+			EXIT( i );
+			break;
+
+		case blk_mov_a_imm: as.mov_imm( reg_a, op.addr ); as.mov_imm( reg_nz, op.addr ); break;
+		case blk_mov_x_imm: as.mov_imm( reg_x, op.addr ); as.mov_imm( reg_nz, op.addr ); break;
+		case blk_mov_y_imm: as.mov_imm( reg_y, op.addr ); as.mov_imm( reg_nz, op.addr ); break;
+		case blk_mov_a_x: as.mov( reg_a, reg_x ); as.mov( reg_nz, reg_x ); break;
+		case blk_mov_a_y: as.mov( reg_a, reg_y ); as.mov( reg_nz, reg_y ); break;
+		case blk_mov_x_a: as.mov( reg_x, reg_a ); as.mov( reg_nz, reg_a ); break;
+		case blk_mov_y_a: as.mov( reg_y, reg_a ); as.mov( reg_nz, reg_a ); break;
+
+		case blk_inc_a: INC_DEC_REG( reg_a, alu_add ); break;
+		case blk_inc_x: INC_DEC_REG( reg_x, alu_add ); break;
+		case blk_inc_y: INC_DEC_REG( reg_y, alu_add ); break;
+		case blk_dec_a: INC_DEC_REG( reg_a, alu_sub ); break;
+		case blk_dec_x: INC_DEC_REG( reg_x, alu_sub ); break;
+		case blk_dec_y: INC_DEC_REG( reg_y, alu_sub ); break;
+
+		case blk_cmp_a_imm: as.mov_imm( rax, op.addr ); CMP( reg_a ); break;
+		case blk_cmp_x_imm: as.mov_imm( rax, op.addr ); CMP( reg_x ); break;
+		case blk_cmp_y_imm: as.mov_imm( rax, op.addr ); CMP( reg_y ); break;
+
+		case blk_and_imm: as.alu_imm( alu_and, reg_a, op.addr ); as.mov( reg_nz, reg_a ); break;
+		case blk_or_imm:  as.alu_imm( alu_or,  reg_a, op.addr ); as.mov( reg_nz, reg_a ); break;
+		case blk_eor_imm: as.alu_imm( alu_xor, reg_a, op.addr ); as.mov( reg_nz, reg_a ); break;
+		case blk_adc_imm: as.mov_imm( rax, op.addr ); ADC(); break;
+
+		case blk_clrc: as.store_imm( off_c, 0 );  break;
+		case blk_setc: as.store_imm( off_c, ~0 ); break;
+		case blk_nop: break;
+
+		case blk_mov_a_dp: READ_DP( 0 ); as.mov( reg_a, rax ); as.mov( reg_nz, rax ); break;
+		case blk_mov_x_dp: READ_DP( 0 ); as.mov( reg_x, rax ); as.mov( reg_nz, rax ); break;
+		case blk_mov_y_dp: READ_DP( 0 ); as.mov( reg_y, rax ); as.mov( reg_nz, rax ); break;
+		case blk_mov_a_abs: READ_ABS(); as.mov( reg_a, rax ); as.mov( reg_nz, rax ); break;
+
+		case blk_cmp_a_dp:  READ_DP( 0 ); CMP( reg_a ); break;
+		case blk_cmp_x_dp:  READ_DP( 0 ); CMP( reg_x ); break;
+		case blk_cmp_y_dp:  READ_DP( 0 ); CMP( reg_y ); break;
+		case blk_cmp_a_abs: READ_ABS();   CMP( reg_a ); break;
+
+		case blk_and_dp: READ_DP( 0 ); as.alu( alu_and, reg_a, rax ); as.mov( reg_nz, reg_a ); break;
+		case blk_or_dp:  READ_DP( 0 ); as.alu( alu_or,  reg_a, rax ); as.mov( reg_nz, reg_a ); break;
+		case blk_eor_dp: READ_DP( 0 ); as.alu( alu_xor, reg_a, rax ); as.mov( reg_nz, reg_a ); break;
+		case blk_adc_dp: READ_DP( 0 ); ADC(); break;
+		case blk_sbc_dp: READ_DP( 0 ); as.alu_imm( alu_xor, rax, 0xFF ); ADC(); break;
+
+		case blk_mov_a_absx:
+		case blk_mov_a_absy:
+		case blk_mov_a_dpx:
+		case blk_mov_a_ix:
+		case blk_mov_a_idy:
+		case blk_mov_absx_a:
+		case blk_mov_absy_a:
+		case blk_mov_dpx_a:
+		case blk_mov_ix_a:
+		case blk_mov_idy_a: {
+			// Calculate address in esi
+			switch ( kind )
+			{
+			case blk_mov_a_absx:
+			case blk_mov_absx_a:
+				as.mov( rsi, reg_x );
+				as.alu_imm( alu_add, rsi, op.addr );
+				break;
+
+			case blk_mov_a_absy:
+			case blk_mov_absy_a:
+				as.mov( rsi, reg_y );
+				as.alu_imm( alu_add, rsi, op.addr );
+				break;
+
+			case blk_mov_a_dpx:
+			case blk_mov_dpx_a:
+				as.mov( rsi, reg_x );
+				as.alu_imm( alu_add, rsi, op.addr );
+				as.alu_imm( alu_and, rsi, 0xFF );
+				as.rm( 0x03, rsi, reg_regs, no_index, off_dp ); // add esi,dp
+				break;
+
+			case blk_mov_a_ix:
+			case blk_mov_ix_a:
+				as.load( rsi, off_dp );
+				as.alu( alu_add, rsi, reg_x );
+				break;
+
+			default: // [dp]+Y
+				as.load( rcx, off_dp );
+				as.load16( rsi, rcx, op.addr );
+				as.alu( alu_add, rsi, reg_y );
+				break;
+			}
+
+			// Plain RAM is below $10000 and outside $F0-$FF, and for writes
+			// outside high memory and the block's own code
+			bool const write = (kind >= blk_mov_absx_a);
+			as.alu_imm( alu_cmp, rsi, (write ? rom_addr : 0x10000) - 1 );
+			uint8_t* const high = as.jcc_fwd( cc_a );
+			as.mov( rax, rsi );
+			as.alu_imm( alu_sub, rax, 0xF0 );
+			as.alu_imm( alu_cmp, rax, reg_count );
+			uint8_t* const io = as.jcc_fwd( cc_b );
+			uint8_t* code = 0;
+			if ( write )
+			{
+				as.mov( rax, rsi );
+				as.alu_imm( alu_sub, rax, b->pc );
+				as.alu_imm( alu_cmp, rax, b->size );
+				code = as.jcc_fwd( cc_b );
+				as.store8( reg_a, rsi, 0 );
+			}
+			else
+			{
+				as.load8( rax, rsi, 0 );
+				as.mov( reg_a, rax );
+				as.mov( reg_nz, rax );
+			}
+			uint8_t* const done = as.jmp_fwd();
+
+			// Otherwise use cpu_read() or cpu_write() and end block
+			as.here( high );
+			as.here( io );
+			if ( code )
+				as.here( code );
+			as.rm( 0x8B, rdi, reg_regs, no_index, REGS_OFFSET( spc ), 1 );
+			if ( write )
+			{
+				as.mov( rdx, rsi );
+				as.mov( rsi, reg_a );
+				LOAD_TIME( rcx, 0 );
+				as.call( (void const*) &jit_write );
+			}
+			else
+			{
+				LOAD_TIME( rdx, 0 );
+				as.call( (void const*) &jit_read );
+				as.mov( reg_a, rax );
+				as.mov( reg_nz, rax );
+			}
+			EXIT( i );
+			as.here( done );
+			break;
+		}
+
+		case blk_mov_dp_a:
+		case blk_mov_dp_x:
+		case blk_mov_dp_y:
+			as.load( rcx, off_dp );
+			as.store8( (kind == blk_mov_dp_a ? reg_a : kind == blk_mov_dp_x ? reg_x : reg_y),
+					rcx, op.addr );
+			break;
+
+		case blk_mov_abs_a:
+			as.store8( reg_a, no_index, op.addr );
+			break;
+
+		case blk_inc_dp:
+		case blk_dec_dp:
+		case blk_inc_abs:
+		case blk_dec_abs: {
+			int index = no_index;
+			if ( kind == blk_inc_dp || kind == blk_dec_dp )
+			{
+				as.load( rcx, off_dp );
+				index = rcx;
+			}
+			as.load8( reg_nz, index, op.addr );
+			as.alu_imm( (kind == blk_inc_dp || kind == blk_inc_abs ? alu_add : alu_sub), reg_nz, 1 );
+			as.store8( reg_nz, index, op.addr );
+			break;
+		}
+
+		case blk_bra:
+		case blk_jmp:
+			break;
+
+		case blk_beq: as.test8( reg_nz ); cond = cc_z;  break;
+		case blk_bne: as.test8( reg_nz ); cond = cc_nz; break;
+		case blk_bmi: as.test_imm( reg_nz, nz_neg_mask ); cond = cc_nz; break;
+		case blk_bpl: as.test_imm( reg_nz, nz_neg_mask ); cond = cc_z;  break;
+		case blk_bcs: as.test_mem_imm( off_c, 0x100 );  cond = cc_nz; break;
+		case blk_bcc: as.test_mem_imm( off_c, 0x100 );  cond = cc_z;  break;
+		case blk_bvs: as.test_mem_imm( off_psw, 0x40 ); cond = cc_nz; break;
+		case blk_bvc: as.test_mem_imm( off_psw, 0x40 ); cond = cc_z;  break;
+
+		case blk_dbnz_y:
+			as.alu_imm( alu_sub, reg_y, 1 );
+			as.alu_imm( alu_and, reg_y, 0xFF );
+			cond = cc_nz;
+			break;
+
+		case blk_cbne_dp:
+			READ_DP( -4 );
+			as.alu( alu_cmp, rax, reg_a );
+			cond = cc_nz;
+			break;
+
+		case blk_dbnz_dp:
+			as.load( rcx, off_dp );
+			as.load8( rax, rcx, op.addr );
+			as.alu_imm( alu_sub, rax, 1 );
+			as.store8( rax, rcx, op.addr );
+			as.test( rax, rax );
+			cond = cc_nz;
+			break;
+		}
+
+		if ( kind == blk_bra || kind == blk_jmp || cond >= 0 )
+		{
+			if ( cond >= 0 )
+				skip = as.jcc_fwd( cond ^ 1 );
+
+			if ( op.target == b->pc )
+			{
+				// Loop back to start if there's time for another run
+				as.load( rax, off_time );
+				as.alu_imm( alu_add, rax, op.time );
+				as.mov( rcx, rax );
+				as.alu_imm( alu_add, rcx, b->time );
+				uint8_t* const out_of_time = as.jcc_fwd( cc_g );
+				as.store( rax, off_time );
+				as.jmp( start );
+				as.here( out_of_time );
+			}
+			EXIT( i | jit_taken );
+
+			if ( skip )
+			{
+				as.here( skip );
+				as.alu_mem_imm( alu_sub, off_time, 2 );
+			}
+		}
+	}
+
+	jit_used = as.pos - jit_code;
+	if ( mprotect( jit_code, jit_code_size, PROT_READ | PROT_EXEC ) )
+	{
+		// No compiled code can be run, including that of other blocks
+		for ( int i = 0; i < (1 << cpu_block_bits); i++ )
+			cpu_blocks [i].native = 0;
+		jit_enabled = false;
+		return false;
+	}
+	b->native = entry;
+	return true;
+}
+
+#endif
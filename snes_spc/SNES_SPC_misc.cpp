@@ -4,7 +4,9 @@
 
 #include "SNES_SPC.h"
 
+#include <stdlib.h>
 #include <string.h>
+#include <new>
 
 /* Copyright (C) 2004-2007 Shay Green. This module is free software; you
 can redistribute it and/or modify it under the terms of the GNU Lesser
@@ -27,13 +29,55 @@ Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA */
 
 //// Init
 
+SNES_SPC::SNES_SPC()
+{
+	resampler = 0;
+
+	#if SPC_CPU_JIT
+		jit_enabled = false;
+		jit_code    = 0;
+		jit_used    = 0;
+	#endif
+}
+
+SNES_SPC::~SNES_SPC()
+{
+	free( resampler );
+
+	#if SPC_CPU_JIT
+		jit_free();
+	#endif
+}
+
 blargg_err_t SNES_SPC::init()
 {
 	memset( &m, 0, sizeof m );
 	dsp.init( RAM );
 
+	#if SPC_CPU_PROFILE
+		cpu_profiler.clear();
+	#endif
+
+	#if SPC_CPU_THREADED
+		for ( int i = 0; i < (1 << cpu_block_bits); i++ )
+			cpu_blocks [i].pc = -1;
+	#endif
+
+	#if SPC_CPU_JIT
+		jit_regs.spc = this;
+		jit_regs.ram = RAM;
+	#endif
+
 	m.tempo = tempo_unit;
 
+	#if SPC_MORE_ACCURACY
+		m.new_accuracy = accuracy_high;
+	#elif SPC_LESS_ACCURATE
+		m.new_accuracy = accuracy_fast;
+	#else
+		m.new_accuracy = accuracy_normal;
+	#endif
+
 	// Most SPC music doesn't need ROM, and almost all the rest only rely
 	// on these two bytes
 	m.rom [0x3E] = 0xFF;
@@ -67,9 +111,7 @@ blargg_err_t SNES_SPC::init()
 		m.cycle_table [i * 2 + 1] = n & 0x0F;
 	}
 
-	#if SPC_LESS_ACCURATE
-		memcpy( reg_times, reg_times_, sizeof reg_times );
-	#endif
+	memcpy( reg_times, reg_times_, sizeof reg_times );
 
 	reset();
 	return 0;
@@ -149,6 +191,7 @@ void SNES_SPC::ram_loaded()
 void SNES_SPC::regs_loaded()
 {
 	enable_rom( REGS [r_control] & 0x80 );
+	update_pages();
 	timers_loaded();
 }
 
@@ -158,9 +201,10 @@ void SNES_SPC::reset_time_regs()
 	m.echo_accessed = 0;
 	m.spc_time      = 0;
 	m.dsp_time      = 0;
-	#if SPC_LESS_ACCURATE
+
+	m.accuracy = m.new_accuracy;
+	if ( m.accuracy == accuracy_fast )
 		m.dsp_time = clocks_per_sample + 1;
-	#endif
 
 	for ( int i = 0; i < timer_count; i++ )
 	{
@@ -173,6 +217,8 @@ void SNES_SPC::reset_time_regs()
 
 	m.extra_clocks = 0;
 	reset_buf();
+	if ( resampler )
+		resampler->clear();
 }
 
 void SNES_SPC::reset_common( int timer_counter_init )
@@ -197,6 +243,7 @@ void SNES_SPC::soft_reset()
 {
 	reset_common( 0 );
 	dsp.soft_reset();
+	update_pages();
 }
 
 void SNES_SPC::reset()
@@ -205,6 +252,7 @@ void SNES_SPC::reset()
 	ram_loaded();
 	reset_common( 0x0F );
 	dsp.reset();
+	update_pages();
 }
 
 char const SNES_SPC::signature [signature_size + 1] =
@@ -266,42 +314,31 @@ void SNES_SPC::reset_buf()
 	while ( out < &m.extra_buf [extra_size / 2] )
 		*out++ = 0;
 
-	m.extra_pos = out;
-	m.buf_begin = 0;
+	m.extra_count = out - m.extra_buf;
+	m.has_output  = false;
 
 	dsp.set_output( 0, 0 );
 }
 
 void SNES_SPC::set_output( sample_t* out, int size )
+{
+	set_output( SPC_DSP::format_int16, out, 0, size );
+}
+
+void SNES_SPC::set_output( sample_format_t format, void* left, void* right, int size )
 {
 	assert( (size & 1) == 0 ); // size must be even
 
 	m.extra_clocks &= clocks_per_sample - 1;
-	if ( out )
+	if ( left )
 	{
-		sample_t const* out_end = out + size;
-		m.buf_begin = out;
-		m.buf_end   = out_end;
-
-		// Copy extra to output
-		sample_t const* in = m.extra_buf;
-		while ( in < m.extra_pos && out < out_end )
-			*out++ = *in++;
+		m.has_output = true;
+		dsp.set_output( format, left, right, size );
 
-		// Handle output being full already
-		if ( out >= out_end )
-		{
-			// Have DSP write to remaining extra space
-			out     = dsp.extra();
-			out_end = &dsp.extra() [extra_size];
-
-			// Copy any remaining extra samples as if DSP wrote them
-			while ( in < m.extra_pos )
-				*out++ = *in++;
-			assert( out <= out_end );
-		}
-
-		dsp.set_output( out, out_end - out );
+		// Copy extra to output as if DSP wrote it, so DSP converts it to the
+		// output format and keeps any that don't fit
+		for ( int i = 0; i < m.extra_count; i += 2 )
+			dsp.write_output( m.extra_buf [i], m.extra_buf [i + 1] );
 	}
 	else
 	{
@@ -311,33 +348,34 @@ void SNES_SPC::set_output( sample_t* out, int size )
 
 void SNES_SPC::save_extra()
 {
-	// Get end pointers
-	sample_t const* main_end = m.buf_end;     // end of data written to buf
-	sample_t const* dsp_end  = dsp.out_pos(); // end of data written to dsp.extra()
-	if ( m.buf_begin <= dsp_end && dsp_end <= main_end )
-	{
-		main_end = dsp_end;
-		dsp_end  = dsp.extra(); // nothing in DSP's extra
-	}
+	// Copy any samples beyond the end of this frame into extra_buf
+	m.extra_count = dsp.copy_extra( sample_count(), m.extra_buf );
+	assert( m.extra_count <= extra_size );
+}
 
-	// Copy any extra samples at these ends into extra_buf
-	sample_t* out = m.extra_buf;
-	sample_t const* in;
-	for ( in = m.buf_begin + sample_count(); in < main_end; in++ )
-		*out++ = *in;
-	for ( in = dsp.extra(); in < dsp_end ; in++ )
-		*out++ = *in;
-
-	m.extra_pos = out;
-	assert( out <= &m.extra_buf [extra_size] );
+void SNES_SPC::save_raw( void* out ) const
+{
+	memcpy( out, &m, offsetof (state_t,tempo) );
+	dsp.save_raw( (char*) out + offsetof (state_t,tempo) );
+}
+
+void SNES_SPC::load_raw( void const* in )
+{
+	memcpy( &m, in, offsetof (state_t,tempo) );
+	dsp.load_raw( (char const*) in + offsetof (state_t,tempo) );
 }
 
 blargg_err_t SNES_SPC::play( int count, sample_t* out )
+{
+	return play( count, SPC_DSP::format_int16, out );
+}
+
+blargg_err_t SNES_SPC::play( int count, sample_format_t format, void* left, void* right )
 {
 	assert( (count & 1) == 0 ); // must be even
 	if ( count )
 	{
-		set_output( out, count );
+		set_output( format, left, right, count );
 		end_frame( count * (clocks_per_sample / 2) );
 	}
 
@@ -346,10 +384,57 @@ blargg_err_t SNES_SPC::play( int count, sample_t* out )
 	return err;
 }
 
+blargg_err_t SNES_SPC::play_stems( int count, sample_t* out, sample_t* stems, void* echo_buf )
+{
+	dsp.set_stems( stems, count, echo_buf );
+	blargg_err_t err = play( count, out );
+	dsp.set_stems( 0, 0, echo_buf );
+	return err;
+}
+
+blargg_err_t SNES_SPC::play_resampled( int count, sample_t* out, int rate )
+{
+	assert( (count & 1) == 0 ); // must be even
+	if ( rate < SPC_Resampler::min_rate || rate > SPC_Resampler::max_rate )
+		return "Invalid sample rate";
+
+	if ( !resampler )
+	{
+		void* p = malloc( sizeof *resampler );
+		if ( !p )
+			return "Out of memory";
+		resampler = new (p) SPC_Resampler;
+	}
+
+	if ( rate != resampler->rate() )
+		resampler->set_rate( rate );
+
+	while ( count > 0 )
+	{
+		int n = (count < SPC_Resampler::max_read ? count : (int) SPC_Resampler::max_read);
+
+		// DSP writes straight into resampler's input
+		int const in = resampler->input_needed( n );
+		if ( in )
+		{
+			blargg_err_t err = play( in * 2, SPC_DSP::format_int16,
+					resampler->input_left(), resampler->input_right() );
+			resampler->input_written( in );
+			if ( err )
+				return err;
+		}
+
+		n = resampler->read( out, n );
+		if ( out )
+			out += n;
+		count -= n;
+	}
+	return 0;
+}
+
 blargg_err_t SNES_SPC::skip( int count )
 {
-	#if SPC_LESS_ACCURATE
-	if ( count > 2 * sample_rate * 2 )
+	if ( m.accuracy == accuracy_fast && count > 2 * sample_rate * 2 )
 	{
 		set_output( 0, 0 );
 
@@ -372,7 +457,13 @@ blargg_err_t SNES_SPC::skip( int count )
 		dsp.write( SPC_DSP::r_kon , m.skipped_kon );
 		clear_echo();
 	}
-	#endif
 
-	return play( count, 0 );
+	// DSP generates all but the last few samples without output, which leaves
+	// the same state as playing them. Last ones are generated normally so that
+	// sums only used for output are exact by the end.
+	if ( count > extra_size )
+		dsp.skip_output( count - extra_size );
+	blargg_err_t err = play( count, 0 );
+	dsp.skip_output( 0 );
+	return err;
 }
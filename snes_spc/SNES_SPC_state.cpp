@@ -113,6 +113,7 @@ void SNES_SPC::copy_state( unsigned char** io, copy_func_t copy )
 
 	// DSP
 	dsp.copy_state( io, copy );
+	update_pages();
 
 	// Timers
 	for ( int i = 0; i < timer_count; i++ )
@@ -0,0 +1,46 @@
+// snes_spc 0.9.0. http://www.slack.net/~ant/
+
+#include "SPC_BRR_Cache.h"
+
+/* Copyright (C) 2026 agent <agent@local>. This module is free software; you
+can redistribute it and/or modify it under the terms of the GNU Lesser
+General Public License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version. This
+module is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+details. You should have received a copy of the GNU Lesser General Public
+License along with this module; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA */
+
+SPC_BRR_Cache::SPC_BRR_Cache() { clear(); }
+
+void SPC_BRR_Cache::clear()
+{
+	for ( int i = 0; i < entry_count; i++ )
+		entries [i].seq.store( 0, std::memory_order_relaxed );
+}
+
+void SPC_BRR_Cache::write( int header, uint8_t const bytes [8],
+		short const hist [2], short const out [16] )
+{
+	uint32_t key [key_size];
+	make_key( key, header, bytes, hist );
+	entry_t* e = find( key );
+
+	// Claim entry by making its sequence number odd
+	uint32_t seq = e->seq.load( std::memory_order_relaxed );
+	if ( (seq & 1) || !e->seq.compare_exchange_strong( seq, seq + 1,
+			std::memory_order_relaxed ) )
+		return;
+	std::atomic_thread_fence( std::memory_order_release );
+
+	for ( int i = 0; i < key_size; i++ )
+		e->key [i].store( key [i], std::memory_order_relaxed );
+
+	for ( int i = 0; i < data_size; i++ )
+		e->data [i].store( (uint16_t) out [i * 2] |
+				(uint32_t) (uint16_t) out [i * 2 + 1] << 16, std::memory_order_relaxed );
+
+	e->seq.store( seq + 2, std::memory_order_release );
+}
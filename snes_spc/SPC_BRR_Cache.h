@@ -0,0 +1,106 @@
+// Cache of decoded BRR blocks that can be shared by several SPC_DSP instances
+
+// snes_spc 0.9.0
+#ifndef SPC_BRR_CACHE_H
+#define SPC_BRR_CACHE_H
+
+#include <cstdint>
+#include <atomic>
+
+// A decoded block depends only on its header, its 8 data bytes and the last
+// two samples decoded before it, so it's looked up by those rather than by
+// address, and songs that share instruments share entries. DSPs using the
+// cache may run in different threads. Entries are replaced when another block
+// hashes to the same slot.
+struct SPC_BRR_Cache {
+public:
+
+	// Clears cache. Must not be called while any DSP is using it.
+	void clear();
+
+	// If block with header, data bytes and previous samples hist [0] (older)
+	// and hist [1] is in cache, writes its 16 samples to out and returns true.
+	bool read( int header, uint8_t const bytes [8], short const hist [2],
+			short out [16] ) const;
+
+	// Adds block decoded to out. Does nothing if another thread is writing
+	// to the same slot.
+	void write( int header, uint8_t const bytes [8], short const hist [2],
+			short const out [16] );
+
+public:
+	SPC_BRR_Cache();
+
+	enum { entry_bits = 13 };
+	enum { entry_count = 1 << entry_bits }; // 512K total
+
+private:
+	// Each entry is guarded by a sequence number that is odd while it's being
+	// written, so a reader can tell when it read a partly written entry.
+	// Sequence number 0 marks an empty entry.
+	enum { key_size = 4 };
+	enum { data_size = 8 };
+	struct alignas (64) entry_t
+	{
+		std::atomic<uint32_t> seq;
+		std::atomic<uint32_t> key  [key_size];
+		std::atomic<uint32_t> data [data_size]; // 16 samples
+	};
+	entry_t entries [entry_count];
+
+	static void make_key( uint32_t key [key_size], int header,
+			uint8_t const bytes [8], short const hist [2] );
+	entry_t* find( uint32_t const key [key_size] ) const;
+};
+
+inline void SPC_BRR_Cache::make_key( uint32_t key [key_size], int header,
+		uint8_t const bytes [8], short const hist [2] )
+{
+	key [0] = bytes [0] | bytes [1] << 8 | bytes [2] << 16 | (uint32_t) bytes [3] << 24;
+	key [1] = bytes [4] | bytes [5] << 8 | bytes [6] << 16 | (uint32_t) bytes [7] << 24;
+	key [2] = (uint16_t) hist [0] | (uint32_t) (uint16_t) hist [1] << 16;
+	key [3] = header & 0xFC; // end and loop flags don't affect decoding
+}
+
+inline SPC_BRR_Cache::entry_t* SPC_BRR_Cache::find( uint32_t const key [key_size] ) const
+{
+	uint32_t h = key [0] * 0x9E3779B1;
+	h = (h ^ key [1]) * 0x85EBCA77;
+	h = (h ^ key [2]) * 0xC2B2AE3D;
+	h = (h ^ key [3]) * 0x9E3779B1;
+	return const_cast<entry_t*> (&entries [h >> (32 - entry_bits)]);
+}
+
+inline bool SPC_BRR_Cache::read( int header, uint8_t const bytes [8],
+		short const hist [2], short out [16] ) const
+{
+	uint32_t key [key_size];
+	make_key( key, header, bytes, hist );
+	entry_t const* e = find( key );
+
+	uint32_t const seq = e->seq.load( std::memory_order_acquire );
+	if ( (seq & 1) || !seq )
+		return false;
+
+	for ( int i = 0; i < key_size; i++ )
+		if ( e->key [i].load( std::memory_order_relaxed ) != key [i] )
+			return false;
+
+	uint32_t data [data_size];
+	for ( int i = 0; i < data_size; i++ )
+		data [i] = e->data [i].load( std::memory_order_relaxed );
+
+	// Entry must not have changed while it was being read
+	std::atomic_thread_fence( std::memory_order_acquire );
+	if ( e->seq.load( std::memory_order_relaxed ) != seq )
+		return false;
+
+	for ( int i = 0; i < data_size; i++ )
+	{
+		out [i * 2    ] = (short) (data [i] & 0xFFFF);
+		out [i * 2 + 1] = (short) (data [i] >> 16);
+	}
+	return true;
+}
+
+#endif
@@ -2,10 +2,23 @@
 
 #include "SPC_DSP.h"
 
+#include "SPC_BRR_Cache.h"
+#include "SPC_Filter.h"
 #include <string.h>
 
 #include "spc_common.h"
 
+// SIMD is used to unpack BRR blocks where available. Define SPC_DSP_NO_SIMD to
+// use only portable code.
+#if !SPC_DSP_NO_SIMD && (defined (__SSE2__) || defined (_M_X64) || \
+		(defined (_M_IX86_FP) && _M_IX86_FP >= 2))
+	#include <emmintrin.h>
+	#define SPC_DSP_SSE2 1
+#elif !SPC_DSP_NO_SIMD && (defined (__ARM_NEON) || defined (__ARM_NEON__))
+	#include <arm_neon.h>
+	#define SPC_DSP_NEON 1
+#endif
+
 /* Copyright (C) 2007 Shay Green. This module is free software; you
 can redistribute it and/or modify it under the terms of the GNU Lesser
 General Public License as published by the Free Software Foundation; either
@@ -41,35 +54,199 @@ static uint8_t const initial_regs [SPC_DSP::register_count] =
 // Access global DSP register
 #define REG(n)      m.regs [r_##n]
 
-// Access voice DSP register
-#define VREG(r,n)   r [v_##n]
+// Access voice DSP register, where r is offset of voice's registers
+#define VREG(r,n)   m.regs [(r) + v_##n]
 
-#define WRITE_SAMPLES( l, r, out ) \
-{\
-	out [0] = l;\
-	out [1] = r;\
-	out += 2;\
-	if ( out >= m.out_end )\
-	{\
-		assert( out == m.out_end );\
-		assert( m.out_end != &m.extra [extra_size] || \
-			(m.extra <= m.out_begin && m.extra < &m.extra [extra_size]) );\
-		out       = m.extra;\
-		m.out_end = &m.extra [extra_size];\
-	}\
-}\
+// Credits host time since previous step to step s when profiling
+#if SPC_DSP_PROFILE
+	#define PROFILE_STEP( s ) profiler.step( SPC_DSP_Profiler::step_##s )
+	#define PROFILE_PART( s ) profiler.part( SPC_DSP_Profiler::step_##s )
+#else
+	#define PROFILE_STEP( s ) ((void) 0)
+	#define PROFILE_PART( s ) ((void) 0)
+#endif
+
+inline void SPC_DSP::write_sample( int l, int r )
+{
+	int const i = m.out_count;
+	if ( i < m.out_size )
+	{
+		m.out_count = i + 1;
+		int const n = i * m.out_step;
+		switch ( m.out_format )
+		{
+		case format_int16:
+			((sample_t*) m.out_left ) [n] = (sample_t) l;
+			((sample_t*) m.out_right) [n] = (sample_t) r;
+			break;
+
+		case format_int32:
+			((int32_t*) m.out_left ) [n] = l;
+			((int32_t*) m.out_right) [n] = r;
+			break;
+
+		default:
+			((float*) m.out_left ) [n] = l * (1.0f / 0x8000);
+			((float*) m.out_right) [n] = r * (1.0f / 0x8000);
+			break;
+		}
+
+		if ( m.stems && i < m.stems_size )
+		{
+			sample_t* out = &m.stems [i * 2];
+			for ( int v = 0; v < voice_count; v++, out += m.stems_size * 2 )
+			{
+				out [0] = (sample_t) m.stem_out [v] [0];
+				out [1] = (sample_t) m.stem_out [v] [1];
+			}
+		}
+	}
+	else
+	{
+		// Output is full, so keep samples in extra
+		sample_t* out = &m.extra [m.extra_pos];
+		out [0] = (sample_t) l;
+		out [1] = (sample_t) r;
+		if ( m.stems )
+		{
+			for ( int v = 0; v < voice_count; v++ )
+			{
+				m.stem_extra [v] [m.extra_pos    ] = (sample_t) m.stem_out [v] [0];
+				m.stem_extra [v] [m.extra_pos + 1] = (sample_t) m.stem_out [v] [1];
+			}
+		}
+		if ( (m.extra_pos += 2) >= extra_size )
+		{
+			assert( !m.out_size ); // only overwritten when not generating output
+			m.extra_pos = 0;
+		}
+	}
+}
+
+inline void SPC_DSP::output( int l, int r )
+{
+	if ( m.filter )
+		m.filter->run( &l, &r );
+	write_sample( l, r );
+}
+
+void SPC_DSP::write_output( int l, int r )
+{
+	// Stems of samples kept by copy_extra() go with them
+	int const pos = m.stem_saved_pos;
+	for ( int v = 0; v < voice_count; v++ )
+	{
+		m.stem_out [v] [0] = 0;
+		m.stem_out [v] [1] = 0;
+		if ( pos < m.stem_saved_count )
+		{
+			m.stem_out [v] [0] = m.stem_saved [v] [pos    ];
+			m.stem_out [v] [1] = m.stem_saved [v] [pos + 1];
+		}
+	}
+	m.stem_saved_pos = pos + 2;
+
+	write_sample( l, r );
+}
 
 void SPC_DSP::set_output( sample_t* out, int size )
+{
+	set_output( format_int16, out, 0, size );
+}
+
+void SPC_DSP::set_output( sample_format_t format, void* left, void* right, int size )
 {
 	assert( (size & 1) == 0 ); // must be even
-	if ( !out )
+	if ( !left )
+		size = 0;
+
+	int step = 1;
+	if ( !right )
 	{
-		out  = m.extra;
-		size = extra_size;
+		// Interleaved
+		step  = 2;
+		right = (char*) left + (format == format_int16 ? sizeof (sample_t) : 4);
 	}
-	m.out_begin = out;
-	m.out       = out;
-	m.out_end   = out + size;
+
+	m.out_format = format;
+	m.out_step   = step;
+	m.out_left   = left;
+	m.out_right  = right;
+	m.out_count  = 0;
+	m.out_size   = size / 2;
+	m.extra_pos  = 0;
+}
+
+int SPC_DSP::copy_extra( int count, sample_t* out )
+{
+	sample_t* const start = out;
+	for ( int i = count / 2; i < m.out_count; i++ )
+	{
+		for ( int v = 0; v < voice_count && m.stems; v++ )
+		{
+			sample_t* saved = &m.stem_saved [v] [out - start];
+			saved [0] = 0;
+			saved [1] = 0;
+			if ( i < m.stems_size )
+			{
+				saved [0] = m.stems [(v * m.stems_size + i) * 2    ];
+				saved [1] = m.stems [(v * m.stems_size + i) * 2 + 1];
+			}
+		}
+
+		int const n = i * m.out_step;
+		switch ( m.out_format )
+		{
+		case format_int16:
+			out [0] = ((sample_t const*) m.out_left ) [n];
+			out [1] = ((sample_t const*) m.out_right) [n];
+			break;
+
+		case format_int32:
+			out [0] = (sample_t) ((int32_t const*) m.out_left ) [n];
+			out [1] = (sample_t) ((int32_t const*) m.out_right) [n];
+			break;
+
+		default:
+			out [0] = (sample_t) (((float const*) m.out_left ) [n] * 0x8000);
+			out [1] = (sample_t) (((float const*) m.out_right) [n] * 0x8000);
+			break;
+		}
+		out += 2;
+	}
+
+	for ( int i = 0; i < m.extra_pos; i++ )
+	{
+		for ( int v = 0; v < voice_count; v++ )
+			m.stem_saved [v] [out - start] = m.stem_extra [v] [i];
+		*out++ = m.extra [i];
+	}
+
+	m.stem_saved_pos   = 0;
+	m.stem_saved_count = (m.stems ? out - start : 0);
+	return out - start;
+}
+
+void SPC_DSP::set_stems( sample_t* stems, int size, void* echo_buf )
+{
+	assert( (size & 1) == 0 ); // must be even
+	if ( !echo_buf )
+		stems = 0;
+
+	// Voices' echoes start out silent when given a new buffer
+	if ( echo_buf != m.stem_echo )
+	{
+		m.stem_echo = (uint8_t*) echo_buf;
+		if ( echo_buf )
+			memset( echo_buf, 0, stem_echo_size );
+		memset( m.stem_hist, 0, sizeof m.stem_hist );
+		memset( m.stem_main, 0, sizeof m.stem_main );
+		memset( m.stem_send, 0, sizeof m.stem_send );
+		memset( m.stem_out,  0, sizeof m.stem_out  );
+	}
+
+	m.stems      = stems;
+	m.stems_size = (stems ? size / 2 : 0);
 }
 
 // Volume registers and efb are signed! Easy to forget int8_t cast.
@@ -171,6 +348,32 @@ static unsigned const counter_offsets [32] =
 	     0
 };
 
+// Bit n of counter_events [counter] is clear when an event at rate n fires,
+// so reading the counter doesn't need a divide. Built once and shared by all
+// instances.
+struct counter_events_t
+{
+	uint32_t bits [simple_counter_range];
+
+	counter_events_t()
+	{
+		for ( int counter = 0; counter < simple_counter_range; counter++ )
+		{
+			uint32_t b = 0;
+			for ( int rate = 0; rate < 32; rate++ )
+				if ( (counter + counter_offsets [rate]) % counter_rates [rate] )
+					b |= (uint32_t) 1 << rate;
+			bits [counter] = b;
+		}
+	}
+};
+
+static uint32_t const* counter_events()
+{
+	static counter_events_t const events;
+	return events.bits;
+}
+
 inline void SPC_DSP::init_counter()
 {
 	m.counter = 0;
@@ -184,7 +387,7 @@ inline void SPC_DSP::run_counters()
 
 inline unsigned SPC_DSP::read_counter( int rate )
 {
-	return ((unsigned) m.counter + counter_offsets [rate]) % counter_rates [rate];
+	return m.counter_events [m.counter] >> rate & 1;
 }
 
 
@@ -272,35 +475,82 @@ inline void SPC_DSP::run_envelope( voice_t* const v )
 
 //// BRR Decoding
 
-inline void SPC_DSP::decode_brr( voice_t* v )
+// Unpacks and shifts the 16 samples of the block in v->brr_bytes, using
+// v->brr_header's shift, into out
+void SPC_DSP::shift_brr( voice_t const* v, short* out )
 {
-	// Arrange the four input nybbles in 0xABCD order for easy decoding
-	int nybbles = m.t_brr_byte * 0x100 + m.ram [(v->brr_addr + v->brr_offset + 1) & 0xFFFF];
-
-	int const header = m.t_brr_header;
-
-	// Write to next four samples in circular buffer
-	int* pos = &v->buf [v->buf_pos];
-	int* end;
-	if ( (v->buf_pos += 4) >= brr_buf_size )
-		v->buf_pos = 0;
-
-	// Decode four samples
-	for ( end = pos + 4; pos < end; pos++, nybbles <<= 4 )
+	int const shift = v->brr_header >> 4;
+
+	// (s << shift) >> 1 is done as ((s << 12) >> (13 - shift)), where s << 12
+	// conveniently fills 16 bits. Invalid shifts of 13-15 give -0x800 or 0.
+	int const count = (shift < 0xD ? 13 - shift : 15);
+	int const mask  = (shift < 0xD ? -1 : -0x800);
+
+#if SPC_DSP_SSE2
+	__m128i const low4 = _mm_set1_epi8( 0x0F );
+	__m128i const b    = _mm_loadl_epi64( (__m128i const*) v->brr_bytes );
+	__m128i const n    = _mm_unpacklo_epi8( _mm_and_si128( _mm_srli_epi16( b, 4 ), low4 ),
+			_mm_and_si128( b, low4 ) ); // nybbles in order, high one of each byte first
+	__m128i const cnt  = _mm_cvtsi32_si128( count );
+	__m128i const msk  = _mm_set1_epi16( (short) mask );
+	__m128i const zero = _mm_setzero_si128();
+	__m128i s0 = _mm_slli_epi16( _mm_unpacklo_epi8( zero, n ), 4 );
+	__m128i s1 = _mm_slli_epi16( _mm_unpackhi_epi8( zero, n ), 4 );
+	s0 = _mm_and_si128( _mm_sra_epi16( s0, cnt ), msk );
+	s1 = _mm_and_si128( _mm_sra_epi16( s1, cnt ), msk );
+	_mm_storeu_si128( (__m128i*) &out [0], s0 );
+	_mm_storeu_si128( (__m128i*) &out [8], s1 );
+#elif SPC_DSP_NEON
+	uint8x8_t   const b   = vld1_u8( v->brr_bytes );
+	uint8x8x2_t const n   = vzip_u8( vshr_n_u8( b, 4 ), vand_u8( b, vdup_n_u8( 0x0F ) ) );
+	int16x8_t   const cnt = vdupq_n_s16( (int16_t) -count );
+	int16x8_t   const msk = vdupq_n_s16( (int16_t) mask );
+	int16x8_t s0 = vshlq_n_s16( vreinterpretq_s16_u16( vmovl_u8( n.val [0] ) ), 12 );
+	int16x8_t s1 = vshlq_n_s16( vreinterpretq_s16_u16( vmovl_u8( n.val [1] ) ), 12 );
+	vst1q_s16( &out [0], vandq_s16( vshlq_s16( s0, cnt ), msk ) );
+	vst1q_s16( &out [8], vandq_s16( vshlq_s16( s1, cnt ), msk ) );
+#else
+	for ( int i = 0; i < brr_block_size - 1; i++ )
 	{
-		// Extract nybble and sign-extend
-		int s = (int16_t) nybbles >> 12;
+		int const byte = v->brr_bytes [i];
+		out [i * 2    ] = (int16_t) (byte >> 4  << 12) >> count & mask;
+		out [i * 2 + 1] = (int16_t) ((byte & 0x0F) << 12) >> count & mask;
+	}
+#endif
+}
 
-		// Shift sample based on header
-		int const shift = header >> 4;
-		s = (s << shift) >> 1;
-		if ( shift >= 0xD ) // handle invalid range
-			s = (s >> 25) << 11; // same as: s = (s < 0 ? -0x800 : 0)
+// Decodes block from the four samples at offset to its end into v->brr_dec,
+// reading block from RAM again
+void SPC_DSP::decode_brr_block( voice_t* v, int offset )
+{
+	for ( int i = 0; i < brr_block_size - 1; i++ )
+		v->brr_bytes [i] = m.ram [(v->brr_addr + 1 + i) & 0xFFFF];
+	v->brr_bytes [offset] = m.t_brr_byte; // RAM might have changed since read
+	v->brr_header = m.t_brr_header;
+
+	short* dec = &v->brr_dec [offset * 2];
+	int const* pos = &v->buf [v->buf_pos];
+	dec [0] = pos [brr_buf_size - 2];
+	dec [1] = pos [brr_buf_size - 1];
+
+	// Only a whole block can come from cache
+	SPC_BRR_Cache* const cache = m.brr_cache;
+	if ( cache && !offset && cache->read( v->brr_header, v->brr_bytes,
+			&v->brr_dec [0], &v->brr_dec [2] ) )
+		return;
+
+	short in [16];
+	shift_brr( v, in );
+
+	int const filter = v->brr_header & 0x0C;
+	for ( int i = offset * 2; i < 16; i++ )
+	{
+		// Shifted sample
+		int s = in [i];
 
 		// Apply IIR filter (8 is the most commonly used)
-		int const filter = header & 0x0C;
-		int const p1 = pos [brr_buf_size - 1];
-		int const p2 = pos [brr_buf_size - 2] >> 1;
+		int const p1 = v->brr_dec [i + 1];
+		int const p2 = v->brr_dec [i] >> 1;
 		if ( filter >= 8 )
 		{
 			s += p1;
@@ -324,9 +574,37 @@ inline void SPC_DSP::decode_brr( voice_t* v )
 
 		// Adjust and write sample
 		CLAMP16( s );
-		s = (int16_t) (s * 2);
-		pos [brr_buf_size] = pos [0] = s; // second copy simplifies wrap-around
+		v->brr_dec [i + 2] = (int16_t) (s * 2);
 	}
+
+	if ( cache && !offset )
+		cache->write( v->brr_header, v->brr_bytes, &v->brr_dec [0], &v->brr_dec [2] );
+}
+
+inline void SPC_DSP::decode_brr( voice_t* v )
+{
+	int const offset = v->brr_offset - 1; // index of first data byte in brr_bytes
+	int const next   = m.ram [(v->brr_addr + v->brr_offset + 1) & 0xFFFF];
+
+	// Whole block is decoded when decoding of it begins. Four decoded samples
+	// depend only on the header, two data bytes and the two samples before
+	// them, so they're used while those match what they were made from. The
+	// CPU can modify the block at any time and KON restarts decoding without
+	// clearing the previous samples, otherwise the rest of the block is
+	// decoded again.
+	int* pos = &v->buf [v->buf_pos];
+	short const* dec = &v->brr_dec [offset * 2];
+	if ( m.t_brr_header != v->brr_header || m.t_brr_byte != v->brr_bytes [offset] ||
+			next != v->brr_bytes [offset + 1] ||
+			pos [brr_buf_size - 2] != dec [0] || pos [brr_buf_size - 1] != dec [1] )
+		decode_brr_block( v, offset );
+
+	// Write to next four samples in circular buffer. Second copy simplifies
+	// wrap-around.
+	for ( int i = 0; i < 4; i++ )
+		pos [brr_buf_size + i] = pos [i] = dec [2 + i];
+	if ( (v->buf_pos += 4) >= brr_buf_size )
+		v->buf_pos = 0;
 }
 
 
@@ -400,7 +678,9 @@ inline VOICE_CLOCK( V3b )
 	m.t_brr_byte   = m.ram [(v->brr_addr + v->brr_offset) & 0xFFFF];
 	m.t_brr_header = m.ram [v->brr_addr]; // brr_addr doesn't need masking
 }
-VOICE_CLOCK( V3c )
+// V3c is split around gaussian interpolation so that fast engine can
+// interpolate all voices at once
+inline void SPC_DSP::voice_V3c_kon( voice_t* const v )
 {
 	// Pitch modulation using previous voice's output
 	if ( m.t_pmon & v->vbit )
@@ -430,19 +710,16 @@ VOICE_CLOCK( V3c )
 		// Pitch is never added during KON
 		m.t_pitch = 0;
 	}
+}
+inline void SPC_DSP::voice_V3c_env( voice_t* const v, int output )
+{
+	// Noise
+	if ( m.t_non & v->vbit )
+		output = (int16_t) (m.noise * 2);
 
-	// Gaussian interpolation
-	{
-		int output = interpolate( v );
-
-		// Noise
-		if ( m.t_non & v->vbit )
-			output = (int16_t) (m.noise * 2);
-
-		// Apply envelope
-		m.t_output = (output * v->env) >> 11 & ~1;
-		v->t_envx_out = (uint8_t) (v->env >> 4);
-	}
+	// Apply envelope
+	m.t_output = (output * v->env) >> 11 & ~1;
+	v->t_envx_out = (uint8_t) (v->env >> 4);
 
 	// Immediate silence due to end of sample or soft reset
 	if ( REG(flg) & 0x80 || (m.t_brr_header & 3) == 1 )
@@ -469,10 +746,35 @@ VOICE_CLOCK( V3c )
 	if ( !v->kon_delay )
 		run_envelope( v );
 }
+VOICE_CLOCK( V3c )
+{
+	voice_V3c_kon( v );
+
+	// Gaussian interpolation, skipped when envelope will make output zero
+	// anyway, as it does for released voices. BRR decoding still runs for
+	// them since its filter uses previous samples after next KON.
+	int output = 0;
+	if ( v->env )
+	{
+		PROFILE_PART( V3c );
+		output = interpolate( v );
+		PROFILE_STEP( interp );
+	}
+
+	voice_V3c_env( v, output );
+}
 inline void SPC_DSP::voice_output( voice_t const* v, int ch )
 {
-	// Apply left/right volume
-	int amp = (m.t_output * (int8_t) VREG(v->regs,voll + ch)) >> 7;
+	// Silent voice adds nothing, and without output only echo needs voice
+	if ( !m.t_output || (m.skip_count && !(m.t_eon & v->vbit)) )
+		return;
+
+	// Apply left/right volume, negating it if surround is disabled and
+	// volumes have opposite signs
+	int vol = (int8_t) VREG(v->regs,voll + ch);
+	if ( (int8_t) VREG(v->regs,voll) * (int8_t) VREG(v->regs,volr) < m.surround_threshold )
+		vol ^= vol >> 7;
+	int amp = (m.t_output * vol) >> 7;
 
 	// Add to output total
 	m.t_main_out [ch] += amp;
@@ -484,6 +786,18 @@ inline void SPC_DSP::voice_output( voice_t const* v, int ch )
 		m.t_echo_out [ch] += amp;
 		CLAMP16( m.t_echo_out [ch] );
 	}
+
+	if ( m.stems )
+	{
+		int const i = v - m.voices;
+		m.stem_main [i] [ch] += amp;
+		CLAMP16( m.stem_main [i] [ch] );
+		if ( m.t_eon & v->vbit )
+		{
+			m.stem_send [i] [ch] += amp;
+			CLAMP16( m.stem_send [i] [ch] );
+		}
+	}
 }
 VOICE_CLOCK( V4 )
 {
@@ -491,7 +805,9 @@ VOICE_CLOCK( V4 )
 	m.t_looped = 0;
 	if ( v->interp_pos >= 0x4000 )
 	{
+		PROFILE_PART( V4 );
 		decode_brr( v );
+		PROFILE_STEP( brr );
 
 		if ( (v->brr_offset += 2) >= brr_block_size )
 		{
@@ -574,7 +890,7 @@ VOICE_CLOCK(V9_V6_V3) { voice_V9(v); voice_V6(v+1); voice_V3(v+2); }
 #define ECHO_PTR( ch )      (&m.ram [m.t_echo_ptr + ch * 2])
 
 // Sample in echo history buffer, where 0 is the oldest
-#define ECHO_FIR( i )       (m.echo_hist_pos [i])
+#define ECHO_FIR( i )       (m.echo_hist [m.echo_hist_pos + (i)])
 
 // Calculate FIR point for left/right channel
 #define CALC_FIR( i, ch )   ((ECHO_FIR( i + 1 ) [ch] * (int8_t) REG(fir + i * 0x10)) >> 6)
@@ -591,8 +907,8 @@ inline void SPC_DSP::echo_read( int ch )
 ECHO_CLOCK( 22 )
 {
 	// History
-	if ( ++m.echo_hist_pos >= &m.echo_hist [echo_hist_size] )
-		m.echo_hist_pos = m.echo_hist;
+	if ( ++m.echo_hist_pos >= echo_hist_size )
+		m.echo_hist_pos = 0;
 
 	m.t_echo_ptr = (m.t_esa * 0x100 + m.echo_offset) & 0xFFFF;
 	echo_read( 0 );
@@ -641,16 +957,72 @@ ECHO_CLOCK( 25 )
 }
 inline int SPC_DSP::echo_output( int ch )
 {
-	int out = (int16_t) ((m.t_main_out [ch] * (int8_t) REG(mvoll + ch * 0x10)) >> 7) +
-			(int16_t) ((m.t_echo_in [ch] * (int8_t) REG(evoll + ch * 0x10)) >> 7);
+	int mvol = (int8_t) REG(mvoll + ch * 0x10);
+	int evol = (int8_t) REG(evoll + ch * 0x10);
+	if ( (int8_t) REG(mvoll) * (int8_t) REG(mvolr) < m.surround_threshold )
+		mvol ^= mvol >> 7;
+	if ( (int8_t) REG(evoll) * (int8_t) REG(evolr) < m.surround_threshold )
+		evol ^= evol >> 7;
+
+	int out = (int16_t) ((m.t_main_out [ch] * mvol) >> 7) +
+			(int16_t) ((m.t_echo_in [ch] * evol) >> 7);
 	CLAMP16( out );
 	return out;
 }
+// Runs each voice's echo and output for its stem, doing what echo_22 through
+// echo_30 do for the main output, at once
+void SPC_DSP::run_stems()
+{
+	int const flg = REG(flg);
+	int const efb = (int8_t) REG(efb);
+	int const hist_pos = m.echo_hist_pos;
+	for ( int ch = 0; ch < 2; ch++ )
+	{
+		int mvol = (int8_t) REG(mvoll + ch * 0x10);
+		int evol = (int8_t) REG(evoll + ch * 0x10);
+		if ( (int8_t) REG(mvoll) * (int8_t) REG(mvolr) < m.surround_threshold )
+			mvol ^= mvol >> 7;
+		if ( (int8_t) REG(evoll) * (int8_t) REG(evolr) < m.surround_threshold )
+			evol ^= evol >> 7;
+
+		for ( int v = 0; v < voice_count; v++ )
+		{
+			uint8_t* echo = &m.stem_echo [v * 0x7800 + m.echo_offset + ch * 2];
+			int (*hist) [2] = &m.stem_hist [v] [hist_pos];
+			hist [0] [ch] = hist [8] [ch] = get_le16( echo ) >> 1;
+
+			// FIR
+			int fir = 0;
+			for ( int i = 0; i < 7; i++ )
+				fir += (hist [i + 1] [ch] * (int8_t) REG(fir + i * 0x10)) >> 6;
+			fir = (int16_t) fir;
+			fir += (int16_t) ((hist [8] [ch] * (int8_t) REG(fir + 0x70)) >> 6);
+			CLAMP16( fir );
+			fir &= ~1;
+
+			// Output
+			int out = (int16_t) ((m.stem_main [v] [ch] * mvol) >> 7) +
+					(int16_t) ((fir * evol) >> 7);
+			CLAMP16( out );
+			m.stem_out [v] [ch] = (flg & 0x40 ? 0 : out);
+
+			// Feedback
+			int fb = m.stem_send [v] [ch] + (int16_t) ((fir * efb) >> 7);
+			CLAMP16( fb );
+			if ( !(flg & 0x20) )
+				set_le16( echo, fb & ~1 );
+
+			m.stem_main [v] [ch] = 0;
+			m.stem_send [v] [ch] = 0;
+		}
+	}
+}
 ECHO_CLOCK( 26 )
 {
 	// Left output volumes
 	// (save sample for next clock so we can output both together)
-	m.t_main_out [0] = echo_output( 0 );
+	if ( !m.skip_count )
+		m.t_main_out [0] = echo_output( 0 );
 
 	// Echo feedback
 	int l = m.t_echo_out [0] + (int16_t) ((m.t_echo_in [0] * (int8_t) REG(efb)) >> 7);
@@ -664,6 +1036,14 @@ ECHO_CLOCK( 26 )
 }
 ECHO_CLOCK( 27 )
 {
+	if ( m.skip_count )
+	{
+		m.skip_count--;
+		m.t_main_out [0] = 0;
+		m.t_main_out [1] = 0;
+		return;
+	}
+
 	// Output
 	int l = m.t_main_out [0];
 	int r = echo_output( 1 );
@@ -682,9 +1062,9 @@ ECHO_CLOCK( 27 )
 	#ifdef SPC_DSP_OUT_HOOK
 		SPC_DSP_OUT_HOOK( l, r );
 	#else
-		sample_t* out = m.out;
-		WRITE_SAMPLES( l, r, out );
-		m.out = out;
+		if ( m.stems )
+			run_stems();
+		output( l, r );
 	#endif
 }
 ECHO_CLOCK( 28 )
@@ -725,6 +1105,10 @@ ECHO_CLOCK( 30 )
 // Execute clock for a particular voice
 #define V( clock, voice )   voice_##clock( &m.voices [voice] );
 
+// Execute echo and misc clocks
+#define ECHO( n )           echo_##n();
+#define MISC( n )           misc_##n();
+
 /* The most common sequence of clocks uses composite operations
 for efficiency. For example, the following are equivalent to the
 individual steps on the right:
@@ -757,22 +1141,52 @@ PHASE(18)                                     V(V8_V5_V2,5)\
 PHASE(19)                                     V(V9_V6_V3,5)\
 PHASE(20)         V(V1,1)                            V(V7,6)V(V4,7)\
 PHASE(21)                                            V(V8,6)V(V5,7)  V(V2,0)  /* t_brr_next_addr order dependency */\
-PHASE(22)  V(V3a,0)                                  V(V9,6)V(V6,7)  echo_22();\
-PHASE(23)                                                   V(V7,7)  echo_23();\
-PHASE(24)                                                   V(V8,7)  echo_24();\
-PHASE(25)  V(V3b,0)                                         V(V9,7)  echo_25();\
-PHASE(26)                                                            echo_26();\
-PHASE(27) misc_27();                                                 echo_27();\
-PHASE(28) misc_28();                                                 echo_28();\
-PHASE(29) misc_29();                                                 echo_29();\
-PHASE(30) misc_30();V(V3c,0)                                         echo_30();\
+PHASE(22)  V(V3a,0)                                  V(V9,6)V(V6,7)  ECHO(22)\
+PHASE(23)                                                   V(V7,7)  ECHO(23)\
+PHASE(24)                                                   V(V8,7)  ECHO(24)\
+PHASE(25)  V(V3b,0)                                         V(V9,7)  ECHO(25)\
+PHASE(26)                                                            ECHO(26)\
+PHASE(27) MISC(27)                                                   ECHO(27)\
+PHASE(28) MISC(28)                                                   ECHO(28)\
+PHASE(29) MISC(29)                                                   ECHO(29)\
+PHASE(30) MISC(30)V(V3c,0)                                           ECHO(30)\
 PHASE(31)  V(V4,0)       V(V1,2)\
 
+#if SPC_DSP_PROFILE
+	// Time every step separately, so composites are expanded
+	#undef V
+	#undef ECHO
+	#undef MISC
+	#define V( clock, voice )   V_##clock( voice )
+	#define ECHO( n )           echo_##n(); PROFILE_STEP( echo_##n );
+	#define MISC( n )           misc_##n(); PROFILE_STEP( misc_##n );
+
+	#define V_STEP( clock, voice ) voice_##clock( &m.voices [voice] ); PROFILE_STEP( clock );
+	#define V_V1( n )  V_STEP( V1,  n )
+	#define V_V2( n )  V_STEP( V2,  n )
+	#define V_V3a( n ) V_STEP( V3a, n )
+	#define V_V3b( n ) V_STEP( V3b, n )
+	#define V_V3c( n ) V_STEP( V3c, n )
+	#define V_V4( n )  V_STEP( V4,  n )
+	#define V_V5( n )  V_STEP( V5,  n )
+	#define V_V6( n )  V_STEP( V6,  n )
+	#define V_V7( n )  V_STEP( V7,  n )
+	#define V_V8( n )  V_STEP( V8,  n )
+	#define V_V9( n )  V_STEP( V9,  n )
+	#define V_V3( n )  V_V3a( n ) V_V3b( n ) V_V3c( n )
+	#define V_V7_V4_V1( n ) V_V7( n ) V_V1( n + 3 ) V_V4( n + 1 )
+	#define V_V8_V5_V2( n ) V_V8( n ) V_V5( n + 1 ) V_V2( n + 2 )
+	#define V_V9_V6_V3( n ) V_V9( n ) V_V6( n + 1 ) V_V3( n + 2 )
+#endif
+
 #if !SPC_DSP_CUSTOM_RUN
 
-void SPC_DSP::run( int clocks_remain )
+// Runs any number of clocks starting at any phase
+void SPC_DSP::run_clocks( int clocks_remain )
 {
-	assert( clocks_remain > 0 );
+	#if SPC_DSP_PROFILE
+		profiler.begin_run();
+	#endif
 
 	int const phase = m.phase;
 	m.phase = (phase + clocks_remain) & 31;
@@ -780,15 +1194,775 @@ void SPC_DSP::run( int clocks_remain )
 	{
 	loop:
 
-		#define PHASE( n ) if ( n && !--clocks_remain ) break; case n:
+		#if SPC_DSP_PROFILE
+			#define PHASE( n ) if ( n ) { profiler.end_phase( n - 1 ); if ( !--clocks_remain ) break; }\
+				case n: if ( !n ) profiler.begin_sample();
+		#else
+			#define PHASE( n ) if ( n && !--clocks_remain ) break; case n:
+		#endif
 		GEN_DSP_TIMING
 		#undef PHASE
 
+		#if SPC_DSP_PROFILE
+			profiler.end_phase( 31 );
+		#endif
+
 		if ( --clocks_remain )
 			goto loop;
 	}
 }
 
+// Runs n whole samples starting at phase 0, without checking for the end
+// after every clock
+void SPC_DSP::run_samples( int n )
+{
+	assert( m.phase == 0 && n > 0 );
+
+	#if SPC_DSP_PROFILE
+		profiler.begin_run();
+		#define PHASE( n ) if ( n ) profiler.end_phase( n - 1 ); else profiler.begin_sample();
+	#else
+		#define PHASE( n )
+	#endif
+	do
+	{
+		GEN_DSP_TIMING
+
+		#if SPC_DSP_PROFILE
+			profiler.end_phase( 31 );
+		#endif
+	}
+	while ( --n );
+	#undef PHASE
+}
+
+void SPC_DSP::run_accurate( int clocks_remain )
+{
+	// Whole samples are run by run_samples() once at start of a sample, which
+	// play() reaches after its first run
+	int const head = -m.phase & 31;
+	if ( clocks_remain >= head + 32 )
+	{
+		if ( head )
+		{
+			run_clocks( head );
+			clocks_remain -= head;
+		}
+		run_samples( clocks_remain >> 5 );
+		clocks_remain &= 31;
+		if ( !clocks_remain )
+			return;
+	}
+	run_clocks( clocks_remain );
+}
+
+
+//// Fast engine
+
+// Voice has released to silence, so its output is zero. Rather than decode
+// BRR and interpolate, just handle key on/off like voice_V3c() and leave
+// the sample position where it is.
+inline void SPC_DSP::silent_V3c_V4( voice_t* const v )
+{
+	m.t_output    = 0;
+	v->t_envx_out = 0;
+	m.t_looped    = 0;
+	if ( m.every_other_sample && (m.kon & v->vbit) )
+	{
+		v->kon_delay = 5;
+		v->env_mode  = env_attack;
+	}
+}
+
+// Gaussian interpolation of all voices at once, giving the same result as
+// interpolate() for each. Samples and gaussian coefficients are gathered from
+// each voice into an array per tap, with a lane for each voice, so the math
+// can be done on all lanes together.
+void SPC_DSP::interpolate_voices( short* out )
+{
+	short in   [4] [voice_count];
+	short coef [4] [voice_count];
+	for ( int i = 0; i < voice_count; i++ )
+	{
+		voice_t const* v = &m.voices [i];
+		int offset = v->interp_pos >> 4 & 0xFF;
+		short const* fwd = gauss + 255 - offset;
+		short const* rev = gauss       + offset;
+		int const* buf = &v->buf [(v->interp_pos >> 12) + v->buf_pos];
+		coef [0] [i] = fwd [  0]; in [0] [i] = (short) buf [0];
+		coef [1] [i] = fwd [256]; in [1] [i] = (short) buf [1];
+		coef [2] [i] = rev [256]; in [2] [i] = (short) buf [2];
+		coef [3] [i] = rev [  0]; in [3] [i] = (short) buf [3];
+	}
+
+#if SPC_DSP_SSE2
+	// 32-bit products of 16-bit samples and coefficients, >> 11, for lanes 0-3
+	// in lo and 4-7 in hi
+	#define INTERP_TAP( i, lo, hi ) \
+	{\
+		__m128i const a  = _mm_loadu_si128( (__m128i const*) in   [i] );\
+		__m128i const b  = _mm_loadu_si128( (__m128i const*) coef [i] );\
+		__m128i const pl = _mm_mullo_epi16( a, b );\
+		__m128i const ph = _mm_mulhi_epi16( a, b );\
+		lo = _mm_srai_epi32( _mm_unpacklo_epi16( pl, ph ), 11 );\
+		hi = _mm_srai_epi32( _mm_unpackhi_epi16( pl, ph ), 11 );\
+	}
+	__m128i lo, hi, tl, th;
+	INTERP_TAP( 0, lo, hi );
+	INTERP_TAP( 1, tl, th ); lo = _mm_add_epi32( lo, tl ); hi = _mm_add_epi32( hi, th );
+	INTERP_TAP( 2, tl, th ); lo = _mm_add_epi32( lo, tl ); hi = _mm_add_epi32( hi, th );
+	lo = _mm_srai_epi32( _mm_slli_epi32( lo, 16 ), 16 ); // (int16_t) out
+	hi = _mm_srai_epi32( _mm_slli_epi32( hi, 16 ), 16 );
+	INTERP_TAP( 3, tl, th ); lo = _mm_add_epi32( lo, tl ); hi = _mm_add_epi32( hi, th );
+	#undef INTERP_TAP
+
+	// Saturating pack does CLAMP16
+	__m128i const result = _mm_and_si128( _mm_packs_epi32( lo, hi ), _mm_set1_epi16( ~1 ) );
+	_mm_storeu_si128( (__m128i*) out, result );
+#elif SPC_DSP_NEON
+	int16x8_t const a0 = vld1q_s16( in [0] ), b0 = vld1q_s16( coef [0] );
+	int16x8_t const a1 = vld1q_s16( in [1] ), b1 = vld1q_s16( coef [1] );
+	int16x8_t const a2 = vld1q_s16( in [2] ), b2 = vld1q_s16( coef [2] );
+	int16x8_t const a3 = vld1q_s16( in [3] ), b3 = vld1q_s16( coef [3] );
+	int32x4_t lo, hi;
+	lo =                  vshrq_n_s32( vmull_s16( vget_low_s16 ( a0 ), vget_low_s16 ( b0 ) ), 11 );
+	hi =                  vshrq_n_s32( vmull_s16( vget_high_s16( a0 ), vget_high_s16( b0 ) ), 11 );
+	lo = vaddq_s32( lo,   vshrq_n_s32( vmull_s16( vget_low_s16 ( a1 ), vget_low_s16 ( b1 ) ), 11 ) );
+	hi = vaddq_s32( hi,   vshrq_n_s32( vmull_s16( vget_high_s16( a1 ), vget_high_s16( b1 ) ), 11 ) );
+	lo = vaddq_s32( lo,   vshrq_n_s32( vmull_s16( vget_low_s16 ( a2 ), vget_low_s16 ( b2 ) ), 11 ) );
+	hi = vaddq_s32( hi,   vshrq_n_s32( vmull_s16( vget_high_s16( a2 ), vget_high_s16( b2 ) ), 11 ) );
+	lo = vmovl_s16( vmovn_s32( lo ) ); // (int16_t) out
+	hi = vmovl_s16( vmovn_s32( hi ) );
+	lo = vaddq_s32( lo,   vshrq_n_s32( vmull_s16( vget_low_s16 ( a3 ), vget_low_s16 ( b3 ) ), 11 ) );
+	hi = vaddq_s32( hi,   vshrq_n_s32( vmull_s16( vget_high_s16( a3 ), vget_high_s16( b3 ) ), 11 ) );
+
+	// Saturating narrow does CLAMP16
+	int16x8_t const result = vcombine_s16( vqmovn_s32( lo ), vqmovn_s32( hi ) );
+	vst1q_s16( out, vandq_s16( result, vdupq_n_s16( ~1 ) ) );
+#else
+	for ( int i = 0; i < voice_count; i++ )
+	{
+		int s;
+		s  = (coef [0] [i] * in [0] [i]) >> 11;
+		s += (coef [1] [i] * in [1] [i]) >> 11;
+		s += (coef [2] [i] * in [2] [i]) >> 11;
+		s = (int16_t) s;
+		s += (coef [3] [i] * in [3] [i]) >> 11;
+		CLAMP16( s );
+		out [i] = (short) (s & ~1);
+	}
+#endif
+}
+
+// Voice is silent if it has released to zero
+#define FAST_SILENT( v ) (!((v)->env | (v)->kon_delay) && (v)->env_mode == env_release)
+
+inline void SPC_DSP::fast_voice( voice_t* const v, int output )
+{
+	voice_V2( v );
+	voice_V3a( v );
+	voice_V3b( v );
+	if ( FAST_SILENT( v ) )
+	{
+		silent_V3c_V4( v );
+	}
+	else
+	{
+		voice_V3c_kon( v );
+		voice_V3c_env( v, output );
+		voice_V4( v );
+	}
+	voice_V5( v );
+	voice_V6( v );
+	voice_V7( v );
+	voice_V8( v );
+	voice_V9( v );
+}
+
+// Does all the work of phases 0 to 31 of accurate engine, but voice by voice.
+// Voice 0 is a sample ahead of the others (its V1 to V4 run in phases 17 to
+// 31, its V5 to V9 in phases 0 to 4), so it's finished first and started last.
+// With no register writes during the sample, the result is the same as the
+// accurate engine's except for voices skipped by silent_V3c_V4(). Echo and
+// misc clocks go between fast_voices_begin() and fast_voices_end().
+inline void SPC_DSP::fast_voices_begin( short* interp )
+{
+	voice_t* const v0 = m.voices;
+
+	// Nothing changes a voice's interpolation input between here and its V3c,
+	// except KON handling, which leaves envelope at zero so output is zero
+	// anyway
+	for ( voice_t* v = v0; v < v0 + voice_count; v++ )
+	{
+		if ( !FAST_SILENT( v ) )
+		{
+			interpolate_voices( interp );
+			break;
+		}
+	}
+
+	voice_V5( v0 );
+	voice_V6( v0 );
+	voice_V7( v0 );
+	voice_V8( v0 );
+	voice_V9( v0 );
+
+	// Directory address is calculated by V1 of following voice, which for
+	// voices 1 and 2 ran during previous sample
+	int const dir = m.t_dir * 0x100;
+	int const srcn2 = m.t_srcn;
+	fast_voice( v0 + 1, interp [1] );
+	m.t_dir_addr = dir + srcn2 * 4;
+	fast_voice( v0 + 2, interp [2] );
+	for ( int i = 3; i < voice_count; i++ )
+	{
+		m.t_dir_addr = dir + VREG(v0 [i].regs,srcn) * 4;
+		fast_voice( v0 + i, interp [i] );
+	}
+
+	m.t_dir_addr = dir + VREG(v0->regs,srcn) * 4;
+	voice_V2( v0 );
+	voice_V3a( v0 );
+	voice_V3b( v0 );
+}
+
+inline void SPC_DSP::fast_voices_end( short const* interp )
+{
+	voice_t* const v0 = m.voices;
+	if ( FAST_SILENT( v0 ) )
+	{
+		silent_V3c_V4( v0 );
+	}
+	else
+	{
+		voice_V3c_kon( v0 );
+		voice_V3c_env( v0, interp [0] );
+		voice_V4( v0 );
+	}
+
+	// V1 of voices 1 and 2, for next sample
+	m.t_dir_addr = m.t_dir * 0x100 + VREG(v0 [1].regs,srcn) * 4;
+	m.t_srcn     = VREG(v0 [2].regs,srcn);
+}
+
+void SPC_DSP::fast_sample()
+{
+	short interp [voice_count];
+	fast_voices_begin( interp );
+	echo_22();
+	echo_23();
+	echo_24();
+	echo_25();
+	echo_26();
+	misc_27();
+	echo_27();
+	misc_28();
+	echo_28();
+	misc_29();
+	echo_29();
+	misc_30();
+	echo_30(); // doesn't depend on voice 0's V3c
+	fast_voices_end( interp );
+}
+
+// Block echo
+
+// Echo of a block of samples is done all at once, after voices have run for
+// all of them. This is only done when it gives the same result as running
+// echo every sample: the block must not read echo that it wrote, and voices
+// must not read any RAM that echo writes during the block.
+
+// Math on 8 lanes of 32-bit values made from 16-bit ones
+#if SPC_DSP_SSE2
+	struct echo_lanes { __m128i lo, hi; };
+
+	// (in [i] * mul) >> shift
+	static inline echo_lanes echo_mul( short const* in, int mul, int shift )
+	{
+		__m128i const a  = _mm_loadu_si128( (__m128i const*) in );
+		__m128i const b  = _mm_set1_epi16( (short) mul );
+		__m128i const pl = _mm_mullo_epi16( a, b );
+		__m128i const ph = _mm_mulhi_epi16( a, b );
+		__m128i const sh = _mm_cvtsi32_si128( shift );
+		echo_lanes r;
+		r.lo = _mm_sra_epi32( _mm_unpacklo_epi16( pl, ph ), sh );
+		r.hi = _mm_sra_epi32( _mm_unpackhi_epi16( pl, ph ), sh );
+		return r;
+	}
+
+	static inline echo_lanes echo_load( short const* in )
+	{
+		__m128i const a = _mm_loadu_si128( (__m128i const*) in );
+		echo_lanes r;
+		r.lo = _mm_srai_epi32( _mm_unpacklo_epi16( a, a ), 16 );
+		r.hi = _mm_srai_epi32( _mm_unpackhi_epi16( a, a ), 16 );
+		return r;
+	}
+
+	static inline echo_lanes echo_add( echo_lanes x, echo_lanes y )
+	{
+		x.lo = _mm_add_epi32( x.lo, y.lo );
+		x.hi = _mm_add_epi32( x.hi, y.hi );
+		return x;
+	}
+
+	// (int16_t) x
+	static inline echo_lanes echo_trunc( echo_lanes x )
+	{
+		x.lo = _mm_srai_epi32( _mm_slli_epi32( x.lo, 16 ), 16 );
+		x.hi = _mm_srai_epi32( _mm_slli_epi32( x.hi, 16 ), 16 );
+		return x;
+	}
+
+	// CLAMP16( x ) & mask
+	static inline void echo_store( short* out, echo_lanes x, int mask )
+	{
+		__m128i const r = _mm_packs_epi32( x.lo, x.hi );
+		_mm_storeu_si128( (__m128i*) out, _mm_and_si128( r, _mm_set1_epi16( (short) mask ) ) );
+	}
+#elif SPC_DSP_NEON
+	struct echo_lanes { int32x4_t lo, hi; };
+
+	static inline echo_lanes echo_mul( short const* in, int mul, int shift )
+	{
+		int16x8_t const a  = vld1q_s16( in );
+		int16x4_t const b  = vdup_n_s16( (int16_t) mul );
+		int32x4_t const sh = vdupq_n_s32( -shift );
+		echo_lanes r;
+		r.lo = vshlq_s32( vmull_s16( vget_low_s16 ( a ), b ), sh );
+		r.hi = vshlq_s32( vmull_s16( vget_high_s16( a ), b ), sh );
+		return r;
+	}
+
+	static inline echo_lanes echo_load( short const* in )
+	{
+		int16x8_t const a = vld1q_s16( in );
+		echo_lanes r;
+		r.lo = vmovl_s16( vget_low_s16 ( a ) );
+		r.hi = vmovl_s16( vget_high_s16( a ) );
+		return r;
+	}
+
+	static inline echo_lanes echo_add( echo_lanes x, echo_lanes y )
+	{
+		x.lo = vaddq_s32( x.lo, y.lo );
+		x.hi = vaddq_s32( x.hi, y.hi );
+		return x;
+	}
+
+	static inline echo_lanes echo_trunc( echo_lanes x )
+	{
+		x.lo = vmovl_s16( vmovn_s32( x.lo ) );
+		x.hi = vmovl_s16( vmovn_s32( x.hi ) );
+		return x;
+	}
+
+	static inline void echo_store( short* out, echo_lanes x, int mask )
+	{
+		int16x8_t const r = vcombine_s16( vqmovn_s32( x.lo ), vqmovn_s32( x.hi ) );
+		vst1q_s16( out, vandq_s16( r, vdupq_n_s16( (int16_t) mask ) ) );
+	}
+#else
+	struct echo_lanes { int v [8]; };
+
+	static inline echo_lanes echo_mul( short const* in, int mul, int shift )
+	{
+		echo_lanes r;
+		for ( int i = 0; i < 8; i++ )
+			r.v [i] = (in [i] * mul) >> shift;
+		return r;
+	}
+
+	static inline echo_lanes echo_load( short const* in )
+	{
+		echo_lanes r;
+		for ( int i = 0; i < 8; i++ )
+			r.v [i] = in [i];
+		return r;
+	}
+
+	static inline echo_lanes echo_add( echo_lanes x, echo_lanes y )
+	{
+		for ( int i = 0; i < 8; i++ )
+			x.v [i] += y.v [i];
+		return x;
+	}
+
+	static inline echo_lanes echo_trunc( echo_lanes x )
+	{
+		for ( int i = 0; i < 8; i++ )
+			x.v [i] = (int16_t) x.v [i];
+		return x;
+	}
+
+	static inline void echo_store( short* out, echo_lanes x, int mask )
+	{
+		for ( int i = 0; i < 8; i++ )
+		{
+			int s = x.v [i];
+			CLAMP16( s );
+			out [i] = (short) (s & mask);
+		}
+	}
+#endif
+
+// True if [a, a + a_size) and [b, b + b_size) overlap, with wrap-around
+static inline bool ram_overlaps( int a, int a_size, int b, int b_size )
+{
+	return ((b - a) & 0xFFFF) < a_size || ((a - b) & 0xFFFF) < b_size;
+}
+
+// True if any voice using directory entry at addr could read RAM at
+// echo .. echo + echo_size during block
+bool SPC_DSP::dir_entry_overlaps( int addr, int echo, int echo_size ) const
+{
+	// At most one BRR decode per sample, so a voice reads through at most
+	// this many bytes from where it starts or loops
+	int const brr_span = (echo_block_size / 4 + 2) * brr_block_size;
+
+	uint8_t const* entry = &m.ram [addr];
+	return ram_overlaps( echo, echo_size, addr, 4 ) ||
+			ram_overlaps( echo, echo_size, get_le16( entry     ), brr_span ) ||
+			ram_overlaps( echo, echo_size, get_le16( entry + 2 ), brr_span );
+}
+
+bool SPC_DSP::echo_block_ok() const
+{
+	if ( m.stems )
+		return false; // voices' echoes are run every sample
+
+	// Voices would mix samples at end of block as if skipping their output
+	if ( m.skip_count && m.skip_count <= echo_block_size )
+		return false;
+
+	// Block is shorter than the shortest non-zero echo buffer, so it only
+	// reads what was written before it. ESA and DIR must already be in
+	// effect, as echo and voices use them a sample after they're read.
+	int const edl_length = (REG(edl) & 0x0F) * 0x800;
+	if ( !m.echo_length || !edl_length || m.t_esa != REG(esa) || m.t_dir != REG(dir) )
+		return false;
+
+	if ( REG(flg) & 0x20 )
+		return true; // echo writes disabled
+
+	int const echo = REG(esa) * 0x100;
+	int const echo_size = (m.echo_length > edl_length ? m.echo_length : edl_length);
+	int const brr_span = (echo_block_size / 4 + 2) * brr_block_size;
+	int const dir = m.t_dir * 0x100;
+
+	// Voices 1 and 2 use directory entries found before block began
+	if ( dir_entry_overlaps( m.t_dir_addr, echo, echo_size ) ||
+			dir_entry_overlaps( dir + m.t_srcn * 4, echo, echo_size ) )
+		return false;
+
+	for ( int i = 0; i < voice_count; i++ )
+	{
+		voice_t const* v = &m.voices [i];
+		if ( ram_overlaps( echo, echo_size, v->brr_addr, brr_span ) ||
+				dir_entry_overlaps( dir + VREG(v->regs,srcn) * 4, echo, echo_size ) )
+			return false;
+	}
+
+	return true;
+}
+
+// Does echo_22 to echo_30 for a block of samples, given main and echo sums
+// from voices for each
+void SPC_DSP::echo_block( short (*main) [echo_block_size], short (*echo) [echo_block_size] )
+{
+	enum { n = echo_block_size };
+
+	// Read echo buffer for whole block, stepping through it as echo_22 and
+	// echo_29 do. History is oldest 7 samples followed by those read.
+	short hist [2] [n + 8];
+	for ( int i = 0; i < 7; i++ )
+	{
+		hist [0] [i] = (short) ECHO_FIR( i + 2 ) [0];
+		hist [1] [i] = (short) ECHO_FIR( i + 2 ) [1];
+	}
+	int ptrs [n];
+	int offset = m.echo_offset;
+	for ( int i = 0; i < n; i++ )
+	{
+		int const ptr = (m.t_esa * 0x100 + offset) & 0xFFFF;
+		ptrs [i] = ptr;
+		hist [0] [i + 7] = (short) (get_le16( &m.ram [ptr    ] ) >> 1);
+		hist [1] [i + 7] = (short) (get_le16( &m.ram [ptr + 2] ) >> 1);
+
+		if ( !offset )
+			m.echo_length = (REG(edl) & 0x0F) * 0x800;
+
+		offset += 4;
+		if ( offset >= m.echo_length )
+			offset = 0;
+
+		if ( ++m.echo_hist_pos >= echo_hist_size )
+			m.echo_hist_pos = 0;
+		ECHO_FIR( 0 ) [0] = ECHO_FIR( 8 ) [0] = hist [0] [i + 7];
+		ECHO_FIR( 0 ) [1] = ECHO_FIR( 8 ) [1] = hist [1] [i + 7];
+	}
+	m.echo_offset = offset;
+	m.t_echo_ptr  = ptrs [n - 1];
+
+	// FIR, output and feedback for 8 samples at a time
+	short fir [2] [n];
+	short out [2] [n];
+	short fb  [2] [n];
+	int const efb = (int8_t) REG(efb);
+	for ( int ch = 0; ch < 2; ch++ )
+	{
+		int mvol = (int8_t) REG(mvoll + ch * 0x10);
+		int evol = (int8_t) REG(evoll + ch * 0x10);
+		if ( (int8_t) REG(mvoll) * (int8_t) REG(mvolr) < m.surround_threshold )
+			mvol ^= mvol >> 7;
+		if ( (int8_t) REG(evoll) * (int8_t) REG(evolr) < m.surround_threshold )
+			evol ^= evol >> 7;
+
+		for ( int i = 0; i < n; i += 8 )
+		{
+			short const* in = &hist [ch] [i];
+			echo_lanes s =  echo_mul( in,     (int8_t) REG(fir + 0x00), 6 );
+			s = echo_add( s, echo_mul( in + 1, (int8_t) REG(fir + 0x10), 6 ) );
+			s = echo_add( s, echo_mul( in + 2, (int8_t) REG(fir + 0x20), 6 ) );
+			s = echo_add( s, echo_mul( in + 3, (int8_t) REG(fir + 0x30), 6 ) );
+			s = echo_add( s, echo_mul( in + 4, (int8_t) REG(fir + 0x40), 6 ) );
+			s = echo_add( s, echo_mul( in + 5, (int8_t) REG(fir + 0x50), 6 ) );
+			s = echo_add( s, echo_mul( in + 6, (int8_t) REG(fir + 0x60), 6 ) );
+			s = echo_add( echo_trunc( s ),
+					echo_trunc( echo_mul( in + 7, (int8_t) REG(fir + 0x70), 6 ) ) );
+			echo_store( &fir [ch] [i], s, ~1 );
+
+			if ( !m.skip_count )
+				echo_store( &out [ch] [i], echo_add(
+						echo_trunc( echo_mul( &main [ch] [i], mvol, 7 ) ),
+						echo_trunc( echo_mul( &fir  [ch] [i], evol, 7 ) ) ), -1 );
+
+			echo_store( &fb [ch] [i], echo_add( echo_load( &echo [ch] [i] ),
+					echo_trunc( echo_mul( &fir [ch] [i], efb, 7 ) ) ), ~1 );
+		}
+		m.t_echo_in [ch] = fir [ch] [n - 1];
+	}
+
+	// Output samples and write echo, in order
+	int const flg = REG(flg);
+	for ( int i = 0; i < n; i++ )
+	{
+		if ( m.skip_count )
+		{
+			m.skip_count--;
+		}
+		else
+		{
+			int l = out [0] [i];
+			int r = out [1] [i];
+			if ( flg & 0x40 )
+			{
+				l = 0;
+				r = 0;
+			}
+
+			#ifdef SPC_DSP_OUT_HOOK
+				SPC_DSP_OUT_HOOK( l, r );
+			#else
+				output( l, r );
+			#endif
+		}
+
+		if ( !(flg & 0x20) )
+		{
+			set_le16( &m.ram [ptrs [i]    ], fb [0] [i] );
+			set_le16( &m.ram [ptrs [i] + 2], fb [1] [i] );
+		}
+	}
+
+	m.t_echo_enabled = flg;
+	m.t_esa          = REG(esa);
+}
+
+// Runs echo_block_size samples, with echo done for the whole block at once
+void SPC_DSP::fast_block()
+{
+	short main [2] [echo_block_size];
+	short echo [2] [echo_block_size];
+	for ( int i = 0; i < echo_block_size; i++ )
+	{
+		short interp [voice_count];
+		fast_voices_begin( interp );
+
+		main [0] [i] = (short) m.t_main_out [0];
+		main [1] [i] = (short) m.t_main_out [1];
+		echo [0] [i] = (short) m.t_echo_out [0];
+		echo [1] [i] = (short) m.t_echo_out [1];
+		m.t_main_out [0] = 0;
+		m.t_main_out [1] = 0;
+		m.t_echo_out [0] = 0;
+		m.t_echo_out [1] = 0;
+
+		misc_27();
+		misc_28();
+		misc_29();
+		misc_30();
+		fast_voices_end( interp );
+	}
+	echo_block( main, echo );
+}
+
+// Silence
+
+// True if every following sample will be silent and leave DSP state the same
+// apart from counters, noise and echo buffer position, until a register is
+// written. SNES_SPC runs DSP up to each register write, so that ends a run.
+bool SPC_DSP::fast_silent() const
+{
+	if ( m.stems )
+		return false; // voices' echoes might still be sounding
+
+	// No KON pending, and nothing left over from last sample
+	if ( m.kon | m.new_kon | m.t_output | m.t_looped |
+			m.t_main_out [0] | m.t_main_out [1] | m.t_echo_out [0] | m.t_echo_out [1] )
+		return false;
+
+	// Echo doesn't write to RAM and is either muted or has no volume
+	int const flg = REG(flg);
+	if ( !(flg & 0x20) || (!(flg & 0x40) && (REG(evoll) | REG(evolr))) )
+		return false;
+
+	for ( int i = 0; i < voice_count; i++ )
+	{
+		voice_t const* v = &m.voices [i];
+		if ( !FAST_SILENT( v ) || v->t_envx_out )
+			return false;
+	}
+
+	return true;
+}
+
+// Runs count samples while fast_silent() is true, doing only what they
+// change. Last sample of a run must be done normally, as this leaves some
+// temporaries the way they were.
+void SPC_DSP::fast_silence( int count )
+{
+	// OUTX and ENVX of silent voices become zero and ENDX doesn't change
+	for ( int i = 0; i < voice_count; i++ )
+	{
+		int const regs = m.voices [i].regs;
+		VREG(regs,outx) = 0;
+		VREG(regs,envx) = 0;
+	}
+	m.outx_buf = 0;
+	m.envx_buf = 0;
+	m.endx_buf = REG(endx);
+
+	m.t_pmon = REG(pmon) & 0xFE;
+	m.t_non  = REG(non);
+	m.t_eon  = REG(eon);
+	m.t_dir  = REG(dir);
+	m.t_dir_addr = m.t_dir * 0x100 + VREG(m.voices [1].regs,srcn) * 4;
+	m.t_srcn     = VREG(m.voices [2].regs,srcn);
+	m.t_echo_enabled = REG(flg);
+
+	int const noise_rate = REG(flg) & 0x1F;
+	do
+	{
+		// Echo still reads and moves through buffer, as echo_22 and echo_29
+		if ( ++m.echo_hist_pos >= echo_hist_size )
+			m.echo_hist_pos = 0;
+		m.t_echo_ptr = (m.t_esa * 0x100 + m.echo_offset) & 0xFFFF;
+		echo_read( 0 );
+		echo_read( 1 );
+
+		m.t_esa = REG(esa);
+		if ( !m.echo_offset )
+			m.echo_length = (REG(edl) & 0x0F) * 0x800;
+		m.echo_offset += 4;
+		if ( m.echo_offset >= m.echo_length )
+			m.echo_offset = 0;
+
+		// misc_29 and misc_30, with no KON
+		if ( (m.every_other_sample ^= 1) != 0 )
+			m.t_koff = REG(koff) | m.mute_mask;
+
+		run_counters();
+		if ( !read_counter( noise_rate ) )
+		{
+			int feedback = (m.noise << 13) ^ (m.noise << 14);
+			m.noise = (feedback & 0x4000) ^ (m.noise >> 1);
+		}
+
+		if ( m.skip_count )
+		{
+			m.skip_count--;
+		}
+		else
+		{
+			#ifdef SPC_DSP_OUT_HOOK
+				SPC_DSP_OUT_HOOK( 0, 0 );
+			#else
+				output( 0, 0 );
+			#endif
+		}
+	}
+	while ( --count );
+}
+
+void SPC_DSP::run_fast( int clocks_remain )
+{
+	int phase = m.phase + clocks_remain;
+	m.phase = phase & 31;
+	for ( int n = phase >> 5; n; )
+	{
+		if ( n > 1 && fast_silent() )
+		{
+			fast_silence( n - 1 );
+			n = 1;
+		}
+		else if ( n >= echo_block_size && echo_block_ok() )
+		{
+			fast_block();
+			n -= echo_block_size;
+		}
+		else
+		{
+			// Don't check again until a block's worth has been run
+			int count = (n < echo_block_size ? n : echo_block_size);
+			n -= count;
+			do
+				fast_sample();
+			while ( --count );
+		}
+	}
+}
+
+void SPC_DSP::run( int clocks_remain )
+{
+	assert( clocks_remain > 0 );
+
+	if ( m.new_engine != m.engine )
+	{
+		// Switch at start of sample, where state means the same to both
+		int n = -m.phase & 31;
+		if ( n <= clocks_remain )
+		{
+			if ( n )
+			{
+				if ( m.engine == engine_fast )
+					run_fast( n );
+				else
+					run_accurate( n );
+				clocks_remain -= n;
+			}
+			m.engine = m.new_engine;
+			if ( !clocks_remain )
+				return;
+		}
+	}
+
+	if ( m.engine == engine_fast )
+		run_fast( clocks_remain );
+	else
+		run_accurate( clocks_remain );
+}
+
 #endif
 
 
@@ -797,11 +1971,25 @@ void SPC_DSP::run( int clocks_remain )
 void SPC_DSP::init( void* ram_64k )
 {
 	m.ram = (uint8_t*) ram_64k;
+	m.counter_events = counter_events();
+	m.brr_cache = 0;
+	m.filter    = 0;
+	m.stems     = 0;
+	m.stem_echo = 0;
+	m.stem_saved_pos   = 0;
+	m.stem_saved_count = 0;
 	mute_voices( 0 );
 	disable_surround( false );
+	skip_output( 0 );
+	m.engine = engine_accurate;
+	set_engine( engine_accurate );
 	set_output( 0, 0 );
 	reset();
 
+	#if SPC_DSP_PROFILE
+		profiler.clear();
+	#endif
+
 	#ifndef NDEBUG
 		// be sure this sign-extends
 		assert( (int16_t) 0x8000 == -0x8000 );
@@ -823,7 +2011,7 @@ void SPC_DSP::soft_reset_common()
 	assert( m.ram ); // init() must have been called already
 
 	m.noise              = 0x4000;
-	m.echo_hist_pos      = m.echo_hist;
+	m.echo_hist_pos      = 0;
 	m.every_other_sample = 1;
 	m.echo_offset        = 0;
 	m.phase              = 0;
@@ -848,7 +2036,7 @@ void SPC_DSP::load( uint8_t const regs [register_count] )
 		voice_t* v = &m.voices [i];
 		v->brr_offset = 1;
 		v->vbit       = 1 << i;
-		v->regs       = &m.regs [i * 0x10];
+		v->regs       = i * 0x10;
 	}
 	m.new_kon = REG(kon);
 	m.t_dir   = REG(dir);
@@ -859,6 +2047,10 @@ void SPC_DSP::load( uint8_t const regs [register_count] )
 
 void SPC_DSP::reset() { load( initial_regs ); }
 
+void SPC_DSP::save_raw( void* out ) const { memcpy( out, &m, raw_size ); }
+
+void SPC_DSP::load_raw( void const* in ) { memcpy( &m, in, raw_size ); }
+
 
 //// State save/load
 
@@ -950,12 +2142,12 @@ void SPC_DSP::copy_state( unsigned char** io, copy_func_t copy )
 		int j;
 		for ( j = 0; j < 2; j++ )
 		{
-			int s = m.echo_hist_pos [i] [j];
+			int s = m.echo_hist [m.echo_hist_pos + i] [j];
 			SPC_COPY( int16_t, s );
 			m.echo_hist [i] [j] = s; // write back at offset 0
 		}
 	}
-	m.echo_hist_pos = m.echo_hist;
+	m.echo_hist_pos = 0;
 	memcpy( &m.echo_hist [echo_hist_size], m.echo_hist, echo_hist_size * sizeof m.echo_hist [0] );
 
 	// Misc
@@ -964,6 +2156,8 @@ void SPC_DSP::copy_state( unsigned char** io, copy_func_t copy )
 
 	SPC_COPY( uint16_t, m.noise );
 	SPC_COPY( uint16_t, m.counter );
+	if ( (unsigned) m.counter >= simple_counter_range )
+		m.counter %= simple_counter_range; // indexes counter_events, so keep in range
 	SPC_COPY( uint16_t, m.echo_offset );
 	SPC_COPY( uint16_t, m.echo_length );
 	SPC_COPY(  uint8_t, m.phase );
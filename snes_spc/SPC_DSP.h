@@ -7,6 +7,13 @@
 #include <cstdint>
 #include <cstddef>
 
+#if SPC_DSP_PROFILE
+	#include "SPC_Profiler.h"
+#endif
+
+struct SPC_BRR_Cache;
+struct SPC_Filter;
+
 extern "C" { typedef void (*dsp_copy_func_t)( unsigned char** io, void* state, size_t ); }
 
 class SPC_DSP {
@@ -22,9 +29,16 @@ public:
 	typedef short sample_t;
 	void set_output( sample_t* out, int out_size );
 
+	// Sets destination for output samples in other formats. Samples are the
+	// same 16-bit values, stored as 32-bit integers or as floats where 0x8000
+	// is 1.0. If right is NULL, left and right samples are interleaved in left,
+	// otherwise each channel is written to its own buffer, out_size / 2 each.
+	enum sample_format_t { format_int16, format_int32, format_float };
+	void set_output( sample_format_t, void* left, void* right, int out_size );
+
 	// Number of samples written to output since it was last set, always
-	// a multiple of 2. Undefined if more samples were generated than
-	// output buffer could hold.
+	// a multiple of 2. Samples beyond what output buffer could hold aren't
+	// counted.
 	int sample_count() const;
 
 // Emulation
@@ -51,6 +65,51 @@ public:
 	enum { voice_count = 8 };
 	void mute_voices( int mask );
 
+	// If true, prevents channels and global volumes from being phase-negated
+	void disable_surround( bool disable = true );
+
+	// Has next count samples (a multiple of 2) generated without output: they
+	// aren't written, and mixing that only goes to them is skipped. All other
+	// state stays the same as when generating them, and what only feeds output
+	// is exact again after the following sample. Filter and stems aren't run
+	// for them. 0 generates output normally again.
+	void skip_output( int count );
+
+// Engine
+
+	// Accurate engine emulates each of the 32 clocks of a sample separately.
+	// Fast engine emulates a whole sample at once when its last clock is run,
+	// so register accesses are only accurate to the sample, and stops
+	// decoding BRR data of voices that have released to silence. A change
+	// takes effect at the start of the next sample. Default is accurate.
+	enum engine_t { engine_accurate, engine_fast };
+	void set_engine( engine_t );
+	engine_t engine() const                 { return m.new_engine; }
+
+	// Has DSP look up decoded BRR blocks in cache and add ones it decodes.
+	// Cache can be shared with other DSPs and doesn't affect output. NULL
+	// stops using a cache, which is the default.
+	void set_brr_cache( SPC_BRR_Cache* c ) { m.brr_cache = c; }
+
+	// Has DSP run output through filter as each sample is generated, saving a
+	// separate pass over the buffer afterwards. NULL stops filtering, which is
+	// the default. Stems aren't filtered.
+	void set_filter( SPC_Filter* f )        { m.filter = f; }
+
+// Stems
+
+	// Has DSP also write each voice's output to its own buffer, as it would
+	// sound if that voice were the only one playing: through main volume and
+	// an echo of its own with the same echo settings. Voice v's stereo samples
+	// are at stems [v * size], size samples per voice, where size is normally
+	// the output size. Each stem sample is at the same position as the output
+	// sample generated with it. echo_buf of stem_echo_size bytes holds the
+	// voices' echo buffers and must be kept between calls; it's cleared when
+	// it isn't the one passed last time. NULL stems stops writing them. Fast
+	// engine doesn't skip silence or run echo in blocks while writing stems.
+	enum { stem_echo_size = voice_count * 0x7800 };
+	void set_stems( sample_t* stems, int size, void* echo_buf );
+
 // State
 
 	// Resets DSP and uses supplied values to initialize registers
@@ -62,9 +121,20 @@ public:
 	typedef dsp_copy_func_t copy_func_t;
 	void copy_state( unsigned char** io, copy_func_t );
 
+	// Saves/loads exact emulator state as raw_size bytes in a single copy.
+	// Only valid for the same build of the library, so it's for keeping
+	// snapshots in memory (rewind, run-ahead), not files.
+	void save_raw( void* out ) const;
+	void load_raw( void const* in );
+
 	// Returns non-zero if new key-on events occurred since last call
 	bool check_kon();
 
+#if SPC_DSP_PROFILE
+	// Host time profile collected since init(), when compiled with SPC_DSP_PROFILE=1
+	SPC_DSP_Profiler& profile() { return profiler; }
+#endif
+
 // DSP register addresses
 
 	// Global registers
@@ -90,10 +160,17 @@ public:
 	};
 
 public:
+	// Used by SNES_SPC to keep samples generated beyond end of its output
 	enum { extra_size = 16 };
-	sample_t* extra()               { return m.extra; }
-	sample_t const* out_pos() const { return m.out; }
-	void disable_surround( bool ) { } // not supported
+
+	// Writes sample pair to output as if DSP had generated it, without
+	// filtering it again
+	void write_output( int l, int r );
+
+	// Copies samples generated after the first count in output to out, as
+	// 16-bit samples, and returns number copied. Stems of these samples are
+	// kept and written with them by write_output().
+	int copy_extra( int count, sample_t* out );
 public:
 
 	enum { echo_hist_size = 8 };
@@ -107,13 +184,16 @@ public:
 		int interp_pos;         // relative fractional position in sample (0x1000 = 1.0)
 		int brr_addr;           // address of current BRR block
 		int brr_offset;         // current decoding offset in BRR block
-		uint8_t* regs;          // pointer to voice's DSP registers
+		int regs;               // offset of voice's DSP registers in regs
 		int vbit;               // bitmask for voice: 0x01 for voice 0, 0x02 for voice 1, etc.
 		int kon_delay;          // KON delay/current setup phase
 		env_mode_t env_mode;
 		int env;                // current envelope level
 		int hidden_env;         // used by GAIN mode 7, very obscure quirk
 		uint8_t t_envx_out;
+		uint8_t brr_header;     // header and data of block decoded into brr_dec
+		uint8_t brr_bytes [8];
+		short brr_dec [2 + 16]; // two samples before block, then decoded block
 	};
 private:
 	enum { brr_block_size = 9 };
@@ -124,7 +204,7 @@ private:
 
 		// Echo history keeps most recent 8 samples (twice the size to simplify wrap handling)
 		int echo_hist [echo_hist_size * 2] [2];
-		int (*echo_hist_pos) [2]; // &echo_hist [0 to 7]
+		int echo_hist_pos;      // index of oldest sample in echo_hist, 0 to 7
 
 		int every_other_sample; // toggles every sample
 		int kon;                // KON value when last checked
@@ -175,20 +255,55 @@ private:
 
 		// non-emulation state
 		uint8_t* ram; // 64K shared RAM between DSP and SMP
+		uint32_t const* counter_events;
+		SPC_BRR_Cache* brr_cache;
+		SPC_Filter* filter;
 		int mute_mask;
-		sample_t* out;
-		sample_t* out_end;
-		sample_t* out_begin;
+		int surround_threshold;
+		int skip_count;         // sample pairs left to generate without output
+		engine_t engine;
+		engine_t new_engine;
+		int out_format;
+		int out_step;           // 2 if interleaved, 1 if planar
+		void* out_left;
+		void* out_right;
+		int out_count;          // sample pairs written to output
+		int out_size;           // sample pairs output can hold
+		int extra_pos;          // samples written to extra once output is full
 		sample_t extra [extra_size];
+
+		// Stems
+		sample_t* stems;
+		int stems_size;         // sample pairs per voice
+		uint8_t* stem_echo;     // echo buffer of each voice
+		int stem_main [voice_count] [2]; // voice output and echo input for sample
+		int stem_send [voice_count] [2];
+		int stem_hist [voice_count] [echo_hist_size * 2] [2];
+		int stem_out  [voice_count] [2]; // stem samples written with next output
+		sample_t stem_extra [voice_count] [extra_size];
+		sample_t stem_saved [voice_count] [extra_size]; // kept by copy_extra()
+		int stem_saved_pos;
+		int stem_saved_count;
 	};
 	state_t m;
 
+public:
+	// Number of bytes save_raw() writes: all emulation state, which has no pointers
+	enum { raw_size = offsetof (state_t,ram) };
+
+private:
+	#if SPC_DSP_PROFILE
+		SPC_DSP_Profiler profiler;
+	#endif
+
 	void init_counter();
 	void run_counters();
 	unsigned read_counter( int rate );
 
 	int  interpolate( voice_t const* v );
 	void run_envelope( voice_t* const v );
+	void shift_brr( voice_t const* v, short* out );
+	void decode_brr_block( voice_t* v, int offset );
 	void decode_brr( voice_t* v );
 
 	void misc_27();
@@ -196,6 +311,9 @@ private:
 	void misc_29();
 	void misc_30();
 
+	void output( int l, int r );
+	void write_sample( int l, int r );
+	void run_stems();
 	void voice_output( voice_t const* v, int ch );
 	void voice_V1( voice_t* const );
 	void voice_V2( voice_t* const );
@@ -203,6 +321,8 @@ private:
 	void voice_V3a( voice_t* const );
 	void voice_V3b( voice_t* const );
 	void voice_V3c( voice_t* const );
+	void voice_V3c_kon( voice_t* const );
+	void voice_V3c_env( voice_t* const, int output );
 	void voice_V4( voice_t* const );
 	void voice_V5( voice_t* const );
 	void voice_V6( voice_t* const );
@@ -226,12 +346,31 @@ private:
 	void echo_29();
 	void echo_30();
 
+	void run_accurate( int clocks );
+	void run_clocks( int clocks );
+	void run_samples( int n );
+	void run_fast( int clocks );
+	void fast_sample();
+	void fast_voices_begin( short* interp );
+	void fast_voices_end( short const* interp );
+	void fast_voice( voice_t* const, int output );
+	void interpolate_voices( short* out );
+	void silent_V3c_V4( voice_t* const );
+
+	enum { echo_block_size = 32 };
+	bool echo_block_ok() const;
+	bool dir_entry_overlaps( int addr, int echo, int echo_size ) const;
+	void echo_block( short (*main) [echo_block_size], short (*echo) [echo_block_size] );
+	void fast_block();
+	bool fast_silent() const;
+	void fast_silence( int count );
+
 	void soft_reset_common();
 };
 
 #include <assert.h>
 
-inline int SPC_DSP::sample_count() const { return m.out - m.out_begin; }
+inline int SPC_DSP::sample_count() const { return m.out_count * 2; }
 
 inline int SPC_DSP::read( int addr ) const
 {
@@ -269,6 +408,16 @@ inline void SPC_DSP::write( int addr, int data )
 
 inline void SPC_DSP::mute_voices( int mask ) { m.mute_mask = mask; }
 
+inline void SPC_DSP::disable_surround( bool disable )
+{
+	// any product of two volumes is greater than -0x4000
+	m.surround_threshold = disable ? 0 : -0x4000;
+}
+
+inline void SPC_DSP::skip_output( int count ) { m.skip_count = count >> 1; }
+
+inline void SPC_DSP::set_engine( engine_t e ) { m.new_engine = e; }
+
 inline bool SPC_DSP::check_kon()
 {
 	bool old = m.kon_check;
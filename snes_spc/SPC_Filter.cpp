@@ -3,6 +3,22 @@
 #include "SPC_Filter.h"
 
 #include <string.h>
+#include <stdint.h>
+
+// SIMD is used to filter left and right together, and several streams at once
+// in SPC_Filter_Bank, where available. Define SPC_DSP_NO_SIMD to use only
+// portable code.
+#if !SPC_DSP_NO_SIMD && defined (__AVX2__)
+	#include <immintrin.h>
+	#define SPC_FILTER_AVX2 1
+#elif !SPC_DSP_NO_SIMD && (defined (__SSE2__) || defined (_M_X64) || \
+		(defined (_M_IX86_FP) && _M_IX86_FP >= 2))
+	#include <emmintrin.h>
+	#define SPC_FILTER_SSE2 1
+#elif !SPC_DSP_NO_SIMD && (defined (__ARM_NEON) || defined (__ARM_NEON__))
+	#include <arm_neon.h>
+	#define SPC_FILTER_NEON 1
+#endif
 
 /* Copyright (C) 2007 Shay Green. This module is free software; you
 can redistribute it and/or modify it under the terms of the GNU Lesser
@@ -26,43 +42,406 @@ SPC_Filter::SPC_Filter()
 	clear();
 }
 
+// Stereo sample pair as one 32-bit value
+static inline int get_pair( short const* p )
+{
+	int32_t s;
+	memcpy( &s, p, sizeof s );
+	return s;
+}
+
+static inline void set_pair( short* p, int s )
+{
+	int32_t const t = s;
+	memcpy( p, &t, sizeof t );
+}
+
+#if SPC_FILTER_AVX2 || SPC_FILTER_SSE2
+	// Low 32 bits of products. SSE2 has no 32-bit multiply, so it uses two
+	// 32x32->64 ones.
+	static inline __m128i mul32( __m128i x, __m128i y )
+	{
+	#if SPC_FILTER_AVX2
+		return _mm_mullo_epi32( x, y );
+	#else
+		__m128i const even = _mm_mul_epu32( x, y );
+		__m128i const odd  = _mm_mul_epu32( _mm_srli_epi64( x, 32 ), _mm_srli_epi64( y, 32 ) );
+		return _mm_unpacklo_epi32( _mm_shuffle_epi32( even, _MM_SHUFFLE( 0, 0, 2, 0 ) ),
+				_mm_shuffle_epi32( odd, _MM_SHUFFLE( 0, 0, 2, 0 ) ) );
+	#endif
+	}
+#endif
+
 void SPC_Filter::run( short* io, int count )
 {
 	assert( (count & 1) == 0 ); // must be even
 
 	int const gain = this->gain;
 	int const bass = this->bass;
-	chan_t* c = &ch [2];
-	do
+
+#if SPC_FILTER_AVX2 || SPC_FILTER_SSE2
+	// Left and right in lanes 0 and 1, with same calculation as calc()
+	__m128i p1  = _mm_set_epi32( 0, 0, ch [1].p1,  ch [0].p1  );
+	__m128i pp1 = _mm_set_epi32( 0, 0, ch [1].pp1, ch [0].pp1 );
+	__m128i sum = _mm_set_epi32( 0, 0, ch [1].sum, ch [0].sum );
+	__m128i const g = _mm_set1_epi32( gain );
+	__m128i const b = _mm_cvtsi32_si128( bass );
+	for ( int i = 0; i < count; i += 2 )
+	{
+		__m128i const x  = _mm_cvtsi32_si128( get_pair( &io [i] ) );
+		__m128i const in = _mm_srai_epi32( _mm_unpacklo_epi16( x, x ), 16 );
+		__m128i const f  = _mm_add_epi32( in, p1 );
+		p1 = _mm_add_epi32( in, _mm_add_epi32( in, in ) );
+
+		__m128i const delta = _mm_sub_epi32( f, pp1 );
+		pp1 = f;
+		__m128i const s = _mm_srai_epi32( sum, gain_bits + 2 );
+		sum = _mm_sub_epi32( _mm_add_epi32( sum, mul32( delta, g ) ), _mm_sra_epi32( sum, b ) );
+
+		set_pair( &io [i], _mm_cvtsi128_si32( _mm_packs_epi32( s, s ) ) );
+	}
+
+	int32_t t [3] [4];
+	_mm_storeu_si128( (__m128i*) t [0], p1  );
+	_mm_storeu_si128( (__m128i*) t [1], pp1 );
+	_mm_storeu_si128( (__m128i*) t [2], sum );
+	for ( int n = 0; n < 2; n++ )
+	{
+		ch [n].p1  = t [0] [n];
+		ch [n].pp1 = t [1] [n];
+		ch [n].sum = t [2] [n];
+	}
+#elif SPC_FILTER_NEON
+	int32_t t [3] [4] = {
+		{ ch [0].p1,  ch [1].p1  },
+		{ ch [0].pp1, ch [1].pp1 },
+		{ ch [0].sum, ch [1].sum }
+	};
+	int32x4_t p1  = vld1q_s32( t [0] );
+	int32x4_t pp1 = vld1q_s32( t [1] );
+	int32x4_t sum = vld1q_s32( t [2] );
+	int32x4_t const b = vdupq_n_s32( -bass );
+	for ( int i = 0; i < count; i += 2 )
+	{
+		int32x4_t const in = vmovl_s16( vreinterpret_s16_s32( vdup_n_s32( get_pair( &io [i] ) ) ) );
+		int32x4_t const f  = vaddq_s32( in, p1 );
+		p1 = vaddq_s32( in, vaddq_s32( in, in ) );
+
+		int32x4_t const delta = vsubq_s32( f, pp1 );
+		pp1 = f;
+		int32x4_t const s = vshrq_n_s32( sum, gain_bits + 2 );
+		sum = vsubq_s32( vaddq_s32( sum, vmulq_n_s32( delta, gain ) ), vshlq_s32( sum, b ) );
+
+		set_pair( &io [i], vget_lane_s32( vreinterpret_s32_s16( vqmovn_s32( s ) ), 0 ) );
+	}
+
+	vst1q_s32( t [0], p1  );
+	vst1q_s32( t [1], pp1 );
+	vst1q_s32( t [2], sum );
+	for ( int n = 0; n < 2; n++ )
+	{
+		ch [n].p1  = t [0] [n];
+		ch [n].pp1 = t [1] [n];
+		ch [n].sum = t [2] [n];
+	}
+#else
+	// Both channels in one pass, with state cached in registers
+	chan_t l = ch [0];
+	chan_t r = ch [1];
+	for ( int i = 0; i < count; i += 2 )
+	{
+		io [i    ] = (short) calc( &l, io [i    ], gain, bass );
+		io [i + 1] = (short) calc( &r, io [i + 1], gain, bass );
+	}
+	ch [0] = l;
+	ch [1] = r;
+#endif
+}
+
+// Filter bank
+
+#if SPC_FILTER_AVX2 || SPC_FILTER_SSE2 || SPC_FILTER_NEON
+	#define SPC_FILTER_LANES 1
+#endif
+
+// Math on 8 lanes of 32-bit values, the left and right channels of 4 streams
+#if SPC_FILTER_AVX2 || SPC_FILTER_SSE2
+	// Stereo sample i of each stream, as 8 16-bit values
+	static inline __m128i read_pairs( short* const io [4], int i )
+	{
+		__m128i const a = _mm_unpacklo_epi32( _mm_cvtsi32_si128( get_pair( &io [0] [i] ) ),
+				_mm_cvtsi32_si128( get_pair( &io [1] [i] ) ) );
+		__m128i const b = _mm_unpacklo_epi32( _mm_cvtsi32_si128( get_pair( &io [2] [i] ) ),
+				_mm_cvtsi32_si128( get_pair( &io [3] [i] ) ) );
+		return _mm_unpacklo_epi64( a, b );
+	}
+
+	static inline void write_pairs( short* const io [4], int i, __m128i p )
+	{
+		set_pair( &io [0] [i], _mm_cvtsi128_si32( p ) );
+		set_pair( &io [1] [i], _mm_cvtsi128_si32( _mm_srli_si128( p,  4 ) ) );
+		set_pair( &io [2] [i], _mm_cvtsi128_si32( _mm_srli_si128( p,  8 ) ) );
+		set_pair( &io [3] [i], _mm_cvtsi128_si32( _mm_srli_si128( p, 12 ) ) );
+	}
+#endif
+
+#if SPC_FILTER_AVX2
+	typedef __m256i filter_lanes;
+
+	static inline filter_lanes lanes_load( int const* in )
+	{
+		return _mm256_load_si256( (__m256i const*) in );
+	}
+
+	static inline void lanes_store( int* out, filter_lanes x )
+	{
+		_mm256_store_si256( (__m256i*) out, x );
+	}
+
+	// Stereo sample i of each stream
+	static inline filter_lanes lanes_read( short* const io [4], int i )
+	{
+		return _mm256_cvtepi16_epi32( read_pairs( io, i ) );
+	}
+
+	// Clamps to 16 bits and writes stereo sample i of each stream
+	static inline void lanes_write( short* const io [4], int i, filter_lanes x )
+	{
+		write_pairs( io, i, _mm_packs_epi32( _mm256_castsi256_si128( x ),
+				_mm256_extracti128_si256( x, 1 ) ) );
+	}
+
+	static inline filter_lanes lanes_add( filter_lanes x, filter_lanes y ) { return _mm256_add_epi32( x, y ); }
+	static inline filter_lanes lanes_sub( filter_lanes x, filter_lanes y ) { return _mm256_sub_epi32( x, y ); }
+	static inline filter_lanes lanes_mul( filter_lanes x, int y ) { return _mm256_mullo_epi32( x, _mm256_set1_epi32( y ) ); }
+	static inline filter_lanes lanes_sra( filter_lanes x, int shift ) { return _mm256_sra_epi32( x, _mm_cvtsi32_si128( shift ) ); }
+#elif SPC_FILTER_SSE2
+	struct filter_lanes { __m128i lo, hi; };
+
+	static inline filter_lanes lanes_load( int const* in )
+	{
+		filter_lanes r;
+		r.lo = _mm_load_si128( (__m128i const*) in );
+		r.hi = _mm_load_si128( (__m128i const*) in + 1 );
+		return r;
+	}
+
+	static inline void lanes_store( int* out, filter_lanes x )
+	{
+		_mm_store_si128( (__m128i*) out,     x.lo );
+		_mm_store_si128( (__m128i*) out + 1, x.hi );
+	}
+
+	static inline filter_lanes lanes_read( short* const io [4], int i )
+	{
+		__m128i const p = read_pairs( io, i );
+		filter_lanes r;
+		r.lo = _mm_srai_epi32( _mm_unpacklo_epi16( p, p ), 16 );
+		r.hi = _mm_srai_epi32( _mm_unpackhi_epi16( p, p ), 16 );
+		return r;
+	}
+
+	static inline void lanes_write( short* const io [4], int i, filter_lanes x )
 	{
-		// cache in registers
-		int sum = (--c)->sum;
-		int pp1 = c->pp1;
-		int p1  = c->p1;
+		write_pairs( io, i, _mm_packs_epi32( x.lo, x.hi ) );
+	}
+
+	static inline filter_lanes lanes_add( filter_lanes x, filter_lanes y )
+	{
+		filter_lanes r;
+		r.lo = _mm_add_epi32( x.lo, y.lo );
+		r.hi = _mm_add_epi32( x.hi, y.hi );
+		return r;
+	}
 
+	static inline filter_lanes lanes_sub( filter_lanes x, filter_lanes y )
+	{
+		filter_lanes r;
+		r.lo = _mm_sub_epi32( x.lo, y.lo );
+		r.hi = _mm_sub_epi32( x.hi, y.hi );
+		return r;
+	}
+
+	static inline filter_lanes lanes_mul( filter_lanes x, int y )
+	{
+		__m128i const m = _mm_set1_epi32( y );
+		filter_lanes r;
+		r.lo = mul32( x.lo, m );
+		r.hi = mul32( x.hi, m );
+		return r;
+	}
+
+	static inline filter_lanes lanes_sra( filter_lanes x, int shift )
+	{
+		__m128i const n = _mm_cvtsi32_si128( shift );
+		filter_lanes r;
+		r.lo = _mm_sra_epi32( x.lo, n );
+		r.hi = _mm_sra_epi32( x.hi, n );
+		return r;
+	}
+#elif SPC_FILTER_NEON
+	struct filter_lanes { int32x4_t lo, hi; };
+
+	static inline filter_lanes lanes_load( int const* in )
+	{
+		filter_lanes r;
+		r.lo = vld1q_s32( in );
+		r.hi = vld1q_s32( in + 4 );
+		return r;
+	}
+
+	static inline void lanes_store( int* out, filter_lanes x )
+	{
+		vst1q_s32( out,     x.lo );
+		vst1q_s32( out + 4, x.hi );
+	}
+
+	static inline filter_lanes lanes_read( short* const io [4], int i )
+	{
+		int32x4_t s = vdupq_n_s32( get_pair( &io [0] [i] ) );
+		s = vsetq_lane_s32( get_pair( &io [1] [i] ), s, 1 );
+		s = vsetq_lane_s32( get_pair( &io [2] [i] ), s, 2 );
+		s = vsetq_lane_s32( get_pair( &io [3] [i] ), s, 3 );
+		int16x8_t const p = vreinterpretq_s16_s32( s );
+		filter_lanes r;
+		r.lo = vmovl_s16( vget_low_s16( p ) );
+		r.hi = vmovl_s16( vget_high_s16( p ) );
+		return r;
+	}
+
+	static inline void lanes_write( short* const io [4], int i, filter_lanes x )
+	{
+		int32x4_t const s = vreinterpretq_s32_s16( vcombine_s16( vqmovn_s32( x.lo ), vqmovn_s32( x.hi ) ) );
+		set_pair( &io [0] [i], vgetq_lane_s32( s, 0 ) );
+		set_pair( &io [1] [i], vgetq_lane_s32( s, 1 ) );
+		set_pair( &io [2] [i], vgetq_lane_s32( s, 2 ) );
+		set_pair( &io [3] [i], vgetq_lane_s32( s, 3 ) );
+	}
+
+	static inline filter_lanes lanes_add( filter_lanes x, filter_lanes y )
+	{
+		filter_lanes r;
+		r.lo = vaddq_s32( x.lo, y.lo );
+		r.hi = vaddq_s32( x.hi, y.hi );
+		return r;
+	}
+
+	static inline filter_lanes lanes_sub( filter_lanes x, filter_lanes y )
+	{
+		filter_lanes r;
+		r.lo = vsubq_s32( x.lo, y.lo );
+		r.hi = vsubq_s32( x.hi, y.hi );
+		return r;
+	}
+
+	static inline filter_lanes lanes_mul( filter_lanes x, int y )
+	{
+		filter_lanes r;
+		r.lo = vmulq_n_s32( x.lo, y );
+		r.hi = vmulq_n_s32( x.hi, y );
+		return r;
+	}
+
+	static inline filter_lanes lanes_sra( filter_lanes x, int shift )
+	{
+		int32x4_t const n = vdupq_n_s32( -shift );
+		filter_lanes r;
+		r.lo = vshlq_s32( x.lo, n );
+		r.hi = vshlq_s32( x.hi, n );
+		return r;
+	}
+#endif
+
+SPC_Filter_Bank::SPC_Filter_Bank()
+{
+	gain = SPC_Filter::gain_unit;
+	bass = SPC_Filter::bass_norm;
+	set_count( 0 );
+}
+
+void SPC_Filter_Bank::set_count( int n )
+{
+	assert( 0 <= n && n <= max_streams );
+	stream_count = n;
+	clear();
+}
+
+void SPC_Filter_Bank::clear()
+{
+	memset( p1,  0, sizeof p1  );
+	memset( pp1, 0, sizeof pp1 );
+	memset( sum, 0, sizeof sum );
+}
+
+void SPC_Filter_Bank::clear( int i )
+{
+	assert( 0 <= i && i < stream_count );
+	p1  [i * 2] = p1  [i * 2 + 1] = 0;
+	pp1 [i * 2] = pp1 [i * 2 + 1] = 0;
+	sum [i * 2] = sum [i * 2 + 1] = 0;
+}
+
+void SPC_Filter_Bank::run( sample_t* const io [], int count )
+{
+	assert( (count & 1) == 0 ); // must be even
+
+	int const gain = this->gain;
+	int const bass = this->bass;
+	int s = 0;
+
+#if SPC_FILTER_LANES
+	// Same calculation as SPC_Filter::calc(), for 4 streams at a time
+	int const out_shift = SPC_Filter::gain_bits + 2;
+	for ( ; s + 4 <= stream_count; s += 4 )
+	{
+		// Local copy so pointers aren't reloaded after every write
+		sample_t* group [4];
+		for ( int n = 0; n < 4; n++ )
+			group [n] = io [s + n];
+
+		filter_lanes p1  = lanes_load( &this->p1  [s * 2] );
+		filter_lanes pp1 = lanes_load( &this->pp1 [s * 2] );
+		filter_lanes sum = lanes_load( &this->sum [s * 2] );
 		for ( int i = 0; i < count; i += 2 )
 		{
-			// Low-pass filter (two point FIR with coeffs 0.25, 0.75)
-			int f = io [i] + p1;
-			p1 = io [i] * 3;
+			filter_lanes const in = lanes_read( group, i );
+			filter_lanes const f = lanes_add( in, p1 );
+			p1 = lanes_add( in, lanes_add( in, in ) );
 
-			// High-pass filter ("leaky integrator")
-			int delta = f - pp1;
+			filter_lanes const delta = lanes_sub( f, pp1 );
 			pp1 = f;
-			int s = sum >> (SPC_Filter::gain_bits + 2);
-			sum += (delta * gain) - (sum >> bass);
+			lanes_write( group, i, lanes_sra( sum, out_shift ) );
+			sum = lanes_sub( lanes_add( sum, lanes_mul( delta, gain ) ), lanes_sra( sum, bass ) );
+		}
+		lanes_store( &this->p1  [s * 2], p1  );
+		lanes_store( &this->pp1 [s * 2], pp1 );
+		lanes_store( &this->sum [s * 2], sum );
+	}
+#endif
 
-			// Clamp to 16 bits
-			if ( (short) s != s )
-				s = (s >> 31) ^ 0x7FFF;
+	// Remaining streams one at a time
+	for ( ; s < stream_count; s++ )
+	{
+		SPC_Filter::chan_t c [2];
+		for ( int n = 0; n < 2; n++ )
+		{
+			c [n].p1  = p1  [s * 2 + n];
+			c [n].pp1 = pp1 [s * 2 + n];
+			c [n].sum = sum [s * 2 + n];
+		}
 
-			io [i] = (short) s;
+		sample_t* out = io [s];
+		for ( int i = 0; i < count; i += 2 )
+		{
+			out [i    ] = (sample_t) SPC_Filter::calc( &c [0], out [i    ], gain, bass );
+			out [i + 1] = (sample_t) SPC_Filter::calc( &c [1], out [i + 1], gain, bass );
 		}
 
-		c->p1  = p1;
-		c->pp1 = pp1;
-		c->sum = sum;
-		++io;
+		for ( int n = 0; n < 2; n++ )
+		{
+			p1  [s * 2 + n] = c [n].p1;
+			pp1 [s * 2 + n] = c [n].pp1;
+			sum [s * 2 + n] = c [n].sum;
+		}
 	}
-	while ( c != ch );
 }
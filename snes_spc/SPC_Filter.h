@@ -11,6 +11,11 @@ public:
 	typedef short sample_t;
 	void run( sample_t* io, int count );
 
+	// Filters one pair of samples in place. SPC_DSP uses this to filter
+	// samples as it generates them, rather than in a pass over the buffer
+	// afterwards. See SPC_DSP::set_filter().
+	void run( int* left, int* right );
+
 // Optional features
 
 	// Clears filter to silence
@@ -36,10 +41,80 @@ private:
 	int bass;
 	struct chan_t { int p1, pp1, sum; };
 	chan_t ch [2];
+
+	static int calc( chan_t* c, int in, int gain, int bass );
+	friend struct SPC_Filter_Bank;
 };
 
+inline int SPC_Filter::calc( chan_t* c, int in, int gain, int bass )
+{
+	// Low-pass filter (two point FIR with coeffs 0.25, 0.75)
+	int f = in + c->p1;
+	c->p1 = in * 3;
+
+	// High-pass filter ("leaky integrator")
+	int delta = f - c->pp1;
+	c->pp1 = f;
+	int s = c->sum >> (gain_bits + 2);
+	c->sum += (delta * gain) - (c->sum >> bass);
+
+	// Clamp to 16 bits
+	if ( (short) s != s )
+		s = (s >> 31) ^ 0x7FFF;
+
+	return s;
+}
+
+inline void SPC_Filter::run( int* left, int* right )
+{
+	*left  = calc( &ch [0], *left,  gain, bass );
+	*right = calc( &ch [1], *right, gain, bass );
+}
+
 inline void SPC_Filter::set_gain( int g ) { gain = g; }
 
 inline void SPC_Filter::set_bass( int b ) { bass = b; }
 
+// Same filter applied to many independent streams at once, each with its own
+// state, which is faster than an SPC_Filter per stream since several streams
+// are filtered together with SIMD
+struct SPC_Filter_Bank {
+public:
+	typedef SPC_Filter::sample_t sample_t;
+
+	// Sets number of streams and clears them
+	enum { max_streams = 512 };
+	void set_count( int n );
+	int count() const               { return stream_count; }
+
+	// Filters count samples of stereo sound in place in each stream, where
+	// io [i] is stream i's buffer. Count must be a multiple of 2.
+	void run( sample_t* const io [], int count );
+
+// Optional features
+
+	// Clears all streams, or just one, to silence
+	void clear();
+	void clear( int stream );
+
+	// Same as for SPC_Filter, but apply to all streams
+	void set_gain( int g )          { gain = g; }
+	void set_bass( int b )          { bass = b; }
+
+public:
+	SPC_Filter_Bank();
+
+private:
+	int stream_count;
+	int gain;
+	int bass;
+
+	// Channel state in separate arrays, left and right of stream i at
+	// [i * 2] and [i * 2 + 1], so it can be loaded directly into SIMD lanes
+	enum { lane_count = max_streams * 2 };
+	alignas (32) int p1  [lane_count];
+	alignas (32) int pp1 [lane_count];
+	alignas (32) int sum [lane_count];
+};
+
 #endif
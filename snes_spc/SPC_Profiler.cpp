@@ -0,0 +1,300 @@
+// snes_spc 0.9.0. http://www.slack.net/~ant/
+
+#include "SPC_Profiler.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+/* Copyright (C) 2026 agent <agent@local>. This module is free software; you
+can redistribute it and/or modify it under the terms of the GNU Lesser
+General Public License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version. This
+module is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+details. You should have received a copy of the GNU Lesser General Public
+License along with this module; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA */
+
+static char const* const mnemonics [256] =
+{
+	"NOP","TCALL 0","SET1 dp.0","BBS dp.0,rel","OR A,dp","OR A,abs","OR A,(X)","OR A,[dp+X]",
+	"OR A,#imm","OR dp,dp","OR1 C,mem.bit","ASL dp","ASL abs","PUSH PSW","TSET1 abs","BRK",
+	"BPL rel","TCALL 1","CLR1 dp.0","BBC dp.0,rel","OR A,dp+X","OR A,abs+X","OR A,abs+Y","OR A,[dp]+Y",
+	"OR dp,#imm","OR (X),(Y)","DECW dp","ASL dp+X","ASL A","DEC X","CMP X,abs","JMP [abs+X]",
+	"CLRP","TCALL 2","SET1 dp.1","BBS dp.1,rel","AND A,dp","AND A,abs","AND A,(X)","AND A,[dp+X]",
+	"AND A,#imm","AND dp,dp","OR1 C,/mem.bit","ROL dp","ROL abs","PUSH A","CBNE dp,rel","BRA rel",
+	"BMI rel","TCALL 3","CLR1 dp.1","BBC dp.1,rel","AND A,dp+X","AND A,abs+X","AND A,abs+Y","AND A,[dp]+Y",
+	"AND dp,#imm","AND (X),(Y)","INCW dp","ROL dp+X","ROL A","INC X","CMP X,dp","CALL abs",
+	"SETP","TCALL 4","SET1 dp.2","BBS dp.2,rel","EOR A,dp","EOR A,abs","EOR A,(X)","EOR A,[dp+X]",
+	"EOR A,#imm","EOR dp,dp","AND1 C,mem.bit","LSR dp","LSR abs","PUSH X","TCLR1 abs","PCALL up",
+	"BVC rel","TCALL 5","CLR1 dp.2","BBC dp.2,rel","EOR A,dp+X","EOR A,abs+X","EOR A,abs+Y","EOR A,[dp]+Y",
+	"EOR dp,#imm","EOR (X),(Y)","CMPW YA,dp","LSR dp+X","LSR A","MOV X,A","CMP Y,abs","JMP abs",
+	"CLRC","TCALL 6","SET1 dp.3","BBS dp.3,rel","CMP A,dp","CMP A,abs","CMP A,(X)","CMP A,[dp+X]",
+	"CMP A,#imm","CMP dp,dp","AND1 C,/mem.bit","ROR dp","ROR abs","PUSH Y","DBNZ dp,rel","RET",
+	"BVS rel","TCALL 7","CLR1 dp.3","BBC dp.3,rel","CMP A,dp+X","CMP A,abs+X","CMP A,abs+Y","CMP A,[dp]+Y",
+	"CMP dp,#imm","CMP (X),(Y)","ADDW YA,dp","ROR dp+X","ROR A","MOV A,X","CMP Y,dp","RETI",
+	"SETC","TCALL 8","SET1 dp.4","BBS dp.4,rel","ADC A,dp","ADC A,abs","ADC A,(X)","ADC A,[dp+X]",
+	"ADC A,#imm","ADC dp,dp","EOR1 C,mem.bit","DEC dp","DEC abs","MOV Y,#imm","POP PSW","MOV dp,#imm",
+	"BCC rel","TCALL 9","CLR1 dp.4","BBC dp.4,rel","ADC A,dp+X","ADC A,abs+X","ADC A,abs+Y","ADC A,[dp]+Y",
+	"ADC dp,#imm","ADC (X),(Y)","SUBW YA,dp","DEC dp+X","DEC A","MOV X,SP","DIV YA,X","XCN A",
+	"EI","TCALL 10","SET1 dp.5","BBS dp.5,rel","SBC A,dp","SBC A,abs","SBC A,(X)","SBC A,[dp+X]",
+	"SBC A,#imm","SBC dp,dp","MOV1 C,mem.bit","INC dp","INC abs","CMP Y,#imm","POP A","MOV (X)+,A",
+	"BCS rel","TCALL 11","CLR1 dp.5","BBC dp.5,rel","SBC A,dp+X","SBC A,abs+X","SBC A,abs+Y","SBC A,[dp]+Y",
+	"SBC dp,#imm","SBC (X),(Y)","MOVW YA,dp","INC dp+X","INC A","MOV SP,X","DAS A","MOV A,(X)+",
+	"DI","TCALL 12","SET1 dp.6","BBS dp.6,rel","MOV dp,A","MOV abs,A","MOV (X),A","MOV [dp+X],A",
+	"CMP X,#imm","MOV abs,X","MOV1 mem.bit,C","MOV dp,Y","MOV abs,Y","MOV X,#imm","POP X","MUL YA",
+	"BNE rel","TCALL 13","CLR1 dp.6","BBC dp.6,rel","MOV dp+X,A","MOV abs+X,A","MOV abs+Y,A","MOV [dp]+Y,A",
+	"MOV dp,X","MOV dp+Y,X","MOVW dp,YA","MOV dp+X,Y","DEC Y","MOV A,Y","CBNE dp+X,rel","DAA A",
+	"CLRV","TCALL 14","SET1 dp.7","BBS dp.7,rel","MOV A,dp","MOV A,abs","MOV A,(X)","MOV A,[dp+X]",
+	"MOV A,#imm","MOV X,abs","NOT1 mem.bit","MOV Y,dp","MOV Y,abs","NOTC","POP Y","SLEEP",
+	"BEQ rel","TCALL 15","CLR1 dp.7","BBC dp.7,rel","MOV A,dp+X","MOV A,abs+X","MOV A,abs+Y","MOV A,[dp]+Y",
+	"MOV X,dp","MOV X,dp+Y","MOV dp,dp","MOV Y,dp+X","INC Y","MOV Y,A","DBNZ Y,rel","STOP"
+};
+
+// Addressing mode group of each opcode, as hex digit indexing group_names
+enum { group_count = 14 };
+static char const* const group_names [group_count] =
+{
+	"implied", "immediate", "dp", "dp+X/Y", "abs", "abs+X/Y", "(X)",
+	"indirect", "dp to dp", "bit", "branch", "call/jump", "stack", "16-bit"
+};
+
+static char const op_groups [16] [17] =
+{
+	"0B9A246718924C4B", // 0
+	"AB9A355786D3004B", // 1
+	"0B9A246718924CAA", // 2
+	"AB9A355786D3002B", // 3
+	"0B9A246718924C4B", // 4
+	"AB9A355786D3004B", // 5
+	"0B9A246718924CAB", // 6
+	"AB9A355786D3002B", // 7
+	"0B9A2467189241C8", // 8
+	"AB9A355786D30000", // 9
+	"0B9A2467189241C6", // A
+	"AB9A355786D30006", // B
+	"0B9A2467149241C0", // C
+	"AB9A355723D300A0", // D
+	"0B9A2467149240C0", // E
+	"AB9A3557238300A0"  // F
+};
+
+static int op_group( int op )
+{
+	int c = op_groups [op >> 4] [op & 0x0F];
+	return (c <= '9' ? c - '0' : c - 'A' + 10);
+}
+
+SPC_CPU_Profiler::SPC_CPU_Profiler()
+{
+	sample_period = 16;
+	clear();
+}
+
+void SPC_CPU_Profiler::clear()
+{
+	memset( ops, 0, sizeof ops );
+	timer_loops      = 0;
+	last_opcode      = -1;
+	last_time        = 0;
+	sampled          = -1;
+	sample_start     = 0;
+	sample_rand      = 1;
+	sample_countdown = next_interval();
+}
+
+void SPC_CPU_Profiler::set_sample_period( int n )
+{
+	sample_period    = (n > 0 ? n : 1);
+	sample_countdown = next_interval();
+}
+
+// Host time of all executions, estimated from sampled ones
+static double est_host( SPC_CPU_Profiler::stat_t const& s )
+{
+	if ( !s.host_samples )
+		return 0;
+	return (double) s.host_ticks / s.host_samples * s.count;
+}
+
+static double percent( double n, double total ) { return total > 0 ? n * 100 / total : 0; }
+
+static SPC_CPU_Profiler::stat_t const* sort_stats;
+
+static int compare_cycles( void const* x, void const* y )
+{
+	uint64_t a = sort_stats [*(unsigned char const*) x].cycles;
+	uint64_t b = sort_stats [*(unsigned char const*) y].cycles;
+	return (a < b) - (a > b);
+}
+
+void SPC_CPU_Profiler::report( FILE* out ) const
+{
+	// Totals and groups
+	stat_t total;
+	memset( &total, 0, sizeof total );
+	double total_host = 0;
+	stat_t groups [group_count];
+	double groups_host [group_count];
+	memset( groups, 0, sizeof groups );
+	memset( groups_host, 0, sizeof groups_host );
+	for ( int i = 0; i < 256; i++ )
+	{
+		stat_t const& s = ops [i];
+		stat_t& g = groups [op_group( i )];
+		double host = est_host( s );
+		total.count  += s.count;
+		total.cycles += s.cycles;
+		total_host   += host;
+		g.count  += s.count;
+		g.cycles += s.cycles;
+		groups_host [op_group( i )] += host;
+	}
+
+	fprintf( out, "SPC-700 profile: %llu instructions, %llu clocks, "
+			"host time sampled 1 in %d instructions on average\n",
+			(unsigned long long) total.count, (unsigned long long) total.cycles,
+			sample_period );
+
+	// Opcodes sorted by emulated clocks
+	unsigned char order [256];
+	for ( int i = 0; i < 256; i++ )
+		order [i] = (unsigned char) i;
+	sort_stats = ops;
+	qsort( order, 256, sizeof order [0], compare_cycles );
+
+	fprintf( out, "op  %-16s %-10s %12s %6s %12s %6s %9s %6s\n",
+			"instruction", "group", "count", "%", "clocks", "%", "ticks/op", "host%" );
+	for ( int i = 0; i < 256; i++ )
+	{
+		int op = order [i];
+		stat_t const& s = ops [op];
+		if ( !s.count )
+			break;
+		fprintf( out, "%02X  %-16s %-10s %12llu %6.2f %12llu %6.2f %9.1f %6.2f\n",
+				op, mnemonics [op], group_names [op_group( op )],
+				(unsigned long long) s.count, percent( (double) s.count, (double) total.count ),
+				(unsigned long long) s.cycles, percent( (double) s.cycles, (double) total.cycles ),
+				s.host_samples ? (double) s.host_ticks / s.host_samples : 0.0,
+				percent( est_host( s ), total_host ) );
+	}
+
+	fprintf( out, "\n%-20s %12s %6s %12s %6s %6s\n",
+			"addressing group", "count", "%", "clocks", "%", "host%" );
+	for ( int i = 0; i < group_count; i++ )
+	{
+		stat_t const& g = groups [i];
+		fprintf( out, "%-20s %12llu %6.2f %12llu %6.2f %6.2f\n", group_names [i],
+				(unsigned long long) g.count, percent( (double) g.count, (double) total.count ),
+				(unsigned long long) g.cycles, percent( (double) g.cycles, (double) total.cycles ),
+				percent( groups_host [i], total_host ) );
+	}
+
+	fprintf( out, "\ntimer polling loop iterations: %llu (%.2f%% of instructions)\n",
+			(unsigned long long) timer_loops, percent( (double) timer_loops, (double) total.count ) );
+}
+
+// SPC_DSP_Profiler
+
+static char const* const step_names [SPC_DSP_Profiler::step_count] =
+{
+	"V1", "V2", "V3a", "V3b", "V3c", "V4", "V5", "V6", "V7", "V8", "V9",
+	"brr", "interp",
+	"echo_22", "echo_23", "echo_24", "echo_25", "echo_26",
+	"echo_27", "echo_28", "echo_29", "echo_30",
+	"misc_27", "misc_28", "misc_29", "misc_30"
+};
+
+SPC_DSP_Profiler::SPC_DSP_Profiler()
+{
+	sample_period = 16;
+	clear();
+}
+
+void SPC_DSP_Profiler::clear()
+{
+	memset( steps,  0, sizeof steps );
+	memset( phases, 0, sizeof phases );
+	memset( hist,   0, sizeof hist );
+	active           = false;
+	last             = 0;
+	phase_start      = 0;
+	phase_marks      = 0;
+	sample_countdown = sample_period;
+
+	// Find least time between two timer reads
+	uint64_t least = ~(uint64_t) 0;
+	for ( int n = 1000; n--; )
+	{
+		uint64_t t = spc_profile_ticks();
+		t = spc_profile_ticks() - t;
+		if ( least > t )
+			least = t;
+	}
+	timer_overhead = (int) least;
+}
+
+void SPC_DSP_Profiler::set_sample_period( int n )
+{
+	sample_period    = (n > 0 ? n : 1);
+	sample_countdown = sample_period;
+}
+
+// Time without overhead of timer reads
+static double net_ticks( SPC_DSP_Profiler::stat_t const& s, int overhead )
+{
+	double t = (double) s.ticks - (double) s.marks * overhead;
+	return (t > 0 ? t : 0);
+}
+
+void SPC_DSP_Profiler::report( FILE* out ) const
+{
+	double total = 0;
+	for ( int i = 0; i < phase_count; i++ )
+		total += net_ticks( phases [i], timer_overhead );
+
+	fprintf( out, "S-DSP profile: %llu samples timed (1 in %d), "
+			"%d ticks of timer overhead removed per step\n",
+			(unsigned long long) phases [31].count, sample_period, timer_overhead );
+
+	fprintf( out, "%-8s %12s %10s %6s\n", "step", "count", "ticks/step", "%" );
+	for ( int i = 0; i < step_count; i++ )
+	{
+		stat_t const& s = steps [i];
+		double t = net_ticks( s, timer_overhead );
+		fprintf( out, "%-8s %12llu %10.1f %6.2f\n", step_names [i],
+				(unsigned long long) s.count, s.count ? t / s.count : 0.0,
+				percent( t, total ) );
+	}
+
+	// Only show histogram buckets that were used
+	int first = hist_size;
+	int end   = 0;
+	for ( int p = 0; p < phase_count; p++ )
+	{
+		for ( int b = 0; b < hist_size; b++ )
+		{
+			if ( hist [p] [b] )
+			{
+				if ( first > b ) first = b;
+				if ( end <= b ) end = b + 1;
+			}
+		}
+	}
+
+	fprintf( out, "\n%-5s %10s %6s  %% of phase taking ticks >= ...\n%-5s %10s %6s ",
+			"phase", "ticks", "%", "", "", "" );
+	for ( int b = first; b < end; b++ )
+		fprintf( out, " %5d", b ? 1 << b : 0 );
+	fprintf( out, "\n" );
+	for ( int p = 0; p < phase_count; p++ )
+	{
+		stat_t const& s = phases [p];
+		double t = net_ticks( s, timer_overhead );
+		fprintf( out, "%-5d %10.1f %6.2f ", p, s.count ? t / s.count : 0.0, percent( t, total ) );
+		for ( int b = first; b < end; b++ )
+			fprintf( out, " %5.1f", percent( (double) hist [p] [b], (double) s.count ) );
+		fprintf( out, "\n" );
+	}
+}
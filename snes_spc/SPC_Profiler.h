@@ -0,0 +1,243 @@
+// Optional profiling of SPC-700 interpreter and S-DSP, enabled with
+// SPC_CPU_PROFILE=1 and SPC_DSP_PROFILE=1
+
+// snes_spc 0.9.0
+#ifndef SPC_PROFILER_H
+#define SPC_PROFILER_H
+
+#include <cstdint>
+#include <stdio.h>
+
+#if defined (__i386__) || defined (__x86_64__)
+	#include <x86intrin.h>
+#else
+	#include <time.h>
+#endif
+
+// Host time stamp. Uses cycle counter where available, otherwise nanoseconds.
+inline uint64_t spc_profile_ticks()
+{
+	#if defined (__i386__) || defined (__x86_64__)
+		return __rdtsc();
+	#else
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC, &ts );
+		return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+	#endif
+}
+
+struct SPC_CPU_Profiler {
+public:
+
+	// Clears all counts
+	void clear();
+
+	// Host time is measured for one in every n instructions on average, since
+	// reading the time stamp costs more than most instructions. Interval is
+	// varied randomly so short loops don't always get sampled at the same
+	// instruction. Default is 16.
+	void set_sample_period( int n );
+
+	// Writes report of opcodes and addressing mode groups sorted by emulated
+	// cycles, and how often timer polling loops were executed
+	void report( FILE* out ) const;
+
+public:
+	SPC_CPU_Profiler();
+
+	struct stat_t
+	{
+		uint64_t count;        // times executed
+		uint64_t cycles;       // emulated clocks taken
+		uint64_t host_ticks;   // host time of sampled executions
+		uint64_t host_samples; // number of sampled executions
+	};
+	stat_t ops [256];
+	uint64_t timer_loops;      // timer polls followed by BEQ back to poll
+
+	// Called by CPU before executing opcode that starts at emulated time
+	void opcode( unsigned opcode, int start_time );
+
+	// Called by CPU when it stops running, at emulated time
+	void stop( int end_time );
+
+private:
+	int      last_opcode; // opcode being executed, or -1 if none
+	int      last_time;
+	int      sampled;     // opcode whose host time is being measured, or -1
+	uint64_t sample_start;
+	int      sample_period;
+	int      sample_countdown;
+	unsigned sample_rand;
+	int next_interval();
+};
+
+inline int SPC_CPU_Profiler::next_interval()
+{
+	// 1 to sample_period * 2 - 1
+	sample_rand = sample_rand * 1103515245 + 12345;
+	return (int) ((sample_rand >> 16) % (unsigned) (sample_period * 2 - 1)) + 1;
+}
+
+inline void SPC_CPU_Profiler::opcode( unsigned op, int start_time )
+{
+	if ( sampled >= 0 )
+	{
+		stat_t* s = &ops [sampled];
+		s->host_ticks += spc_profile_ticks() - sample_start;
+		s->host_samples++;
+		sampled = -1;
+	}
+
+	if ( last_opcode >= 0 )
+		ops [last_opcode].cycles += start_time - last_time;
+	ops [op].count++;
+	last_opcode = op;
+	last_time   = start_time;
+
+	if ( !--sample_countdown )
+	{
+		sample_countdown = next_interval();
+		sampled = op;
+		sample_start = spc_profile_ticks();
+	}
+}
+
+inline void SPC_CPU_Profiler::stop( int end_time )
+{
+	if ( last_opcode >= 0 )
+		ops [last_opcode].cycles += end_time - last_time;
+	last_opcode = -1;
+	sampled     = -1;
+}
+
+struct SPC_DSP_Profiler {
+public:
+
+	// Clears all counts
+	void clear();
+
+	// Timing every clock slows DSP down a lot, so only one in every n samples
+	// is timed. Default is 16.
+	void set_sample_period( int n );
+
+	// Writes report of host time taken by each step and each of the 32 phases
+	// of a sample, with a histogram of time per phase
+	void report( FILE* out ) const;
+
+public:
+	SPC_DSP_Profiler();
+
+	// Steps of DSP. brr and interp are timed separately from the V4 and V3c
+	// steps they are part of.
+	enum {
+		step_V1, step_V2, step_V3a, step_V3b, step_V3c, step_V4,
+		step_V5, step_V6, step_V7, step_V8, step_V9,
+		step_brr, step_interp,
+		step_echo_22, step_echo_23, step_echo_24, step_echo_25, step_echo_26,
+		step_echo_27, step_echo_28, step_echo_29, step_echo_30,
+		step_misc_27, step_misc_28, step_misc_29, step_misc_30,
+		step_count
+	};
+	enum { phase_count = 32 };
+	enum { hist_size = 16 }; // log2 buckets of ticks per phase
+
+	struct stat_t
+	{
+		uint64_t count; // times timed
+		uint64_t ticks; // host time, including timer overhead
+		uint64_t marks; // timer reads included in ticks
+	};
+	stat_t   steps  [step_count];
+	stat_t   phases [phase_count];
+	uint64_t hist   [phase_count] [hist_size];
+	int      timer_overhead; // host ticks taken by one timer read
+
+	// Called by DSP at start of run(), at start of each sample, after each
+	// step, and at end of each phase. part() credits time to a step without
+	// counting it, for when a step is interrupted by a separately timed one.
+	void begin_run();
+	void begin_sample();
+	void part( int s );
+	void step( int s );
+	void end_phase( int phase );
+
+private:
+	bool     active;      // true if current sample is being timed
+	uint64_t last;        // time of last step
+	uint64_t phase_start;
+	uint64_t phase_marks;
+	int      sample_period;
+	int      sample_countdown;
+};
+
+inline void SPC_DSP_Profiler::begin_run()
+{
+	if ( active )
+	{
+		last        = spc_profile_ticks();
+		phase_start = last;
+		phase_marks = 0;
+	}
+}
+
+inline void SPC_DSP_Profiler::begin_sample()
+{
+	active = false;
+	if ( !--sample_countdown )
+	{
+		sample_countdown = sample_period;
+		active = true;
+		begin_run();
+	}
+}
+
+inline void SPC_DSP_Profiler::part( int s )
+{
+	if ( active )
+	{
+		uint64_t t = spc_profile_ticks();
+		stat_t* st = &steps [s];
+		st->ticks += t - last;
+		st->marks++;
+		phase_marks++;
+		last = t;
+	}
+}
+
+inline void SPC_DSP_Profiler::step( int s )
+{
+	if ( active )
+	{
+		part( s );
+		steps [s].count++;
+	}
+}
+
+inline void SPC_DSP_Profiler::end_phase( int phase )
+{
+	if ( active )
+	{
+		uint64_t t = last - phase_start;
+		stat_t* st = &phases [phase];
+		st->count++;
+		st->ticks += t;
+		st->marks += phase_marks;
+
+		// Histogram of time without timer overhead
+		uint64_t overhead = phase_marks * timer_overhead;
+		t = (t > overhead ? t - overhead : 0);
+		int bucket = 0;
+		while ( t > 1 && bucket < hist_size - 1 )
+		{
+			t >>= 1;
+			bucket++;
+		}
+		hist [phase] [bucket]++;
+
+		phase_start = last;
+		phase_marks = 0;
+	}
+}
+
+#endif
@@ -0,0 +1,237 @@
+// snes_spc 0.9.0. http://www.slack.net/~ant/
+
+#include "SPC_Resampler.h"
+
+#include <string.h>
+#include <math.h>
+
+// SIMD is used for the filter where available. Define SPC_DSP_NO_SIMD to use
+// only portable code.
+#if !SPC_DSP_NO_SIMD && (defined (__SSE2__) || defined (_M_X64) || \
+		(defined (_M_IX86_FP) && _M_IX86_FP >= 2))
+	#include <emmintrin.h>
+	#define SPC_RESAMPLER_SSE2 1
+#elif !SPC_DSP_NO_SIMD && (defined (__ARM_NEON) || defined (__ARM_NEON__))
+	#include <arm_neon.h>
+	#define SPC_RESAMPLER_NEON 1
+#endif
+
+/* Copyright (C) 2026 agent <agent@local>. This module is free software; you
+can redistribute it and/or modify it under the terms of the GNU Lesser
+General Public License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version. This
+module is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+details. You should have received a copy of the GNU Lesser General Public
+License along with this module; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA */
+
+#include <cassert>
+
+SPC_Resampler::SPC_Resampler()
+{
+	set_rate( 48000 );
+}
+
+void SPC_Resampler::clear()
+{
+	memset( buf, 0, sizeof buf );
+	frac    = 0;
+	buf_pos = 0;
+	buf_end = taps / 2 - 1; // silence before first input sample
+}
+
+// Modified Bessel function of the first kind, order 0
+static double bessel_i0( double x )
+{
+	double sum  = 1.0;
+	double term = 1.0;
+	for ( int k = 1; k < 32; k++ )
+	{
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum  += term;
+	}
+	return sum;
+}
+
+void SPC_Resampler::set_rate( int rate )
+{
+	assert( min_rate <= rate && rate <= max_rate );
+	out_rate = rate;
+
+	// Step between output samples as in_rate / out_rate in lowest terms
+	int a = in_rate;
+	int b = rate;
+	while ( b )
+	{
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	int const num = in_rate / a;
+	den       = rate / a;
+	step      = num / den;
+	step_frac = num % den;
+
+	// Common rates like 44100 and 48000 need few enough phases to be exact,
+	// others use the nearest one
+	phases = (den < max_phases ? den : max_phases);
+
+	// Kaiser-windowed sinc, cut off below lower of the two Nyquist rates
+	double const pi     = 3.14159265358979323846;
+	double const beta   = 8.0;
+	double const cutoff = 0.45 * (rate < in_rate ? (double) rate / in_rate : 1.0);
+	double const half   = taps / 2;
+	double const i0_beta = bessel_i0( beta );
+	for ( int p = 0; p < phases; p++ )
+	{
+		double h [taps];
+		double sum = 0;
+		for ( int k = 0; k < taps; k++ )
+		{
+			// Distance of input sample from output sample
+			double const d = k - (half - 1) - (double) p / phases;
+			double const x = 2 * cutoff * d;
+			double s = 2 * cutoff;
+			if ( x != 0 )
+				s = sin( pi * x ) / (pi * d);
+			double const w = d / half;
+			h [k] = s * bessel_i0( beta * sqrt( 1 - w * w ) ) / i0_beta;
+			sum += h [k];
+		}
+
+		// Scale for unity gain at DC, with rounding error added to largest tap
+		int total = 0;
+		int largest = 0;
+		for ( int k = 0; k < taps; k++ )
+		{
+			int c = (int) floor( h [k] * (1 << gain_bits) / sum + 0.5 );
+			filter [p] [k] = (short) c;
+			total += c;
+			if ( c > filter [p] [largest] )
+				largest = k;
+		}
+		filter [p] [largest] += (1 << gain_bits) - total;
+	}
+
+	clear();
+}
+
+int SPC_Resampler::input_needed( int count ) const
+{
+	assert( 0 <= count && count <= max_read );
+	int const pairs = count / 2;
+	if ( !pairs )
+		return 0;
+
+	// End of input used by last output sample
+	int const last = pairs - 1;
+	int const end  = buf_pos + step * last + (frac + step_frac * last) / den + taps;
+	return (end > buf_end ? end - buf_end : 0);
+}
+
+void SPC_Resampler::input_written( int pairs )
+{
+	buf_end += pairs;
+	assert( buf_end <= buf_size );
+}
+
+int SPC_Resampler::read( sample_t* out, int count )
+{
+	int const pairs = count / 2;
+	int n = 0;
+	for ( ; n < pairs && buf_pos + taps <= buf_end; n++ )
+	{
+		if ( out )
+		{
+			// Nearest phase, except past the last one, which would belong
+			// to the next input sample
+			int phase = (frac * phases + den / 2) / den;
+			if ( phase >= phases )
+				phase = phases - 1;
+			short const* const c = filter [phase];
+			short const* const l = &buf [0] [buf_pos];
+			short const* const r = &buf [1] [buf_pos];
+
+		#if SPC_RESAMPLER_SSE2
+			__m128i sl = _mm_setzero_si128();
+			__m128i sr = _mm_setzero_si128();
+			for ( int k = 0; k < taps; k += 8 )
+			{
+				__m128i const f = _mm_load_si128( (__m128i const*) &c [k] );
+				sl = _mm_add_epi32( sl, _mm_madd_epi16( _mm_loadu_si128( (__m128i const*) &l [k] ), f ) );
+				sr = _mm_add_epi32( sr, _mm_madd_epi16( _mm_loadu_si128( (__m128i const*) &r [k] ), f ) );
+			}
+
+			// Add lanes so left and right totals end up in lanes 0 and 1, then
+			// round, clamp and store both
+			__m128i s = _mm_add_epi32( _mm_unpacklo_epi32( sl, sr ), _mm_unpackhi_epi32( sl, sr ) );
+			s = _mm_add_epi32( s, _mm_srli_si128( s, 8 ) );
+			s = _mm_srai_epi32( _mm_add_epi32( s, _mm_set1_epi32( 1 << (gain_bits - 1) ) ), gain_bits );
+			s = _mm_packs_epi32( s, s );
+			int const lr = _mm_cvtsi128_si32( s );
+			memcpy( &out [n * 2], &lr, sizeof lr );
+		#elif SPC_RESAMPLER_NEON
+			int32x4_t sl = vdupq_n_s32( 0 );
+			int32x4_t sr = vdupq_n_s32( 0 );
+			for ( int k = 0; k < taps; k += 8 )
+			{
+				int16x8_t const f  = vld1q_s16( &c [k] );
+				int16x8_t const vl = vld1q_s16( &l [k] );
+				int16x8_t const vr = vld1q_s16( &r [k] );
+				sl = vmlal_s16( sl, vget_low_s16( vl ), vget_low_s16( f ) );
+				sl = vmlal_s16( sl, vget_high_s16( vl ), vget_high_s16( f ) );
+				sr = vmlal_s16( sr, vget_low_s16( vr ), vget_low_s16( f ) );
+				sr = vmlal_s16( sr, vget_high_s16( vr ), vget_high_s16( f ) );
+			}
+			int32x2_t const s = vpadd_s32(
+					vpadd_s32( vget_low_s32( sl ), vget_high_s32( sl ) ),
+					vpadd_s32( vget_low_s32( sr ), vget_high_s32( sr ) ) );
+			vst1_lane_s32( (int32_t*) (void*) &out [n * 2],
+					vreinterpret_s32_s16( vqrshrn_n_s32( vcombine_s32( s, s ), gain_bits ) ), 0 );
+		#else
+			int sl = 0;
+			int sr = 0;
+			for ( int k = 0; k < taps; k++ )
+			{
+				sl += l [k] * c [k];
+				sr += r [k] * c [k];
+			}
+			sl = (sl + (1 << (gain_bits - 1))) >> gain_bits;
+			sr = (sr + (1 << (gain_bits - 1))) >> gain_bits;
+			if ( (short) sl != sl )
+				sl = (sl >> 31) ^ 0x7FFF;
+			if ( (short) sr != sr )
+				sr = (sr >> 31) ^ 0x7FFF;
+			out [n * 2    ] = (short) sl;
+			out [n * 2 + 1] = (short) sr;
+		#endif
+		}
+
+		// Advance to next output sample
+		buf_pos += step;
+		if ( (frac += step_frac) >= den )
+		{
+			frac -= den;
+			buf_pos++;
+		}
+	}
+
+	// Keep unused input at beginning of buffer
+	int const remain = buf_end - buf_pos;
+	if ( remain > 0 )
+	{
+		memmove( &buf [0] [0], &buf [0] [buf_pos], remain * sizeof buf [0] [0] );
+		memmove( &buf [1] [0], &buf [1] [buf_pos], remain * sizeof buf [1] [0] );
+		buf_end = remain;
+		buf_pos = 0;
+	}
+	else
+	{
+		buf_pos -= buf_end;
+		buf_end  = 0;
+	}
+
+	return n * 2;
+}
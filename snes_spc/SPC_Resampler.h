@@ -0,0 +1,66 @@
+// Band-limited resampler from the SPC's 32 kHz output to other sample rates
+
+// snes_spc 0.9.0
+#ifndef SPC_RESAMPLER_H
+#define SPC_RESAMPLER_H
+
+struct SPC_Resampler {
+public:
+
+	// Sets output sample rate and clears resampler. Input is always 32000 Hz.
+	enum { in_rate  = 32000 };
+	enum { min_rate = 8000 };
+	enum { max_rate = 192000 };
+	void set_rate( int rate );
+	int rate() const                { return out_rate; }
+
+	// Clears history and phase, as if input had been silent
+	void clear();
+
+// Streaming
+
+	// Number of input sample pairs that must be written before count samples
+	// can be read. Count must not be greater than max_read.
+	enum { max_read = 2048 };
+	int input_needed( int count ) const;
+
+	// Buffers to write input to, with left and right channels separate, and
+	// number of sample pairs written to them. Up to input_needed( max_read )
+	// pairs can be written at once.
+	typedef short sample_t;
+	sample_t* input_left()          { return &buf [0] [buf_end]; }
+	sample_t* input_right()         { return &buf [1] [buf_end]; }
+	void input_written( int pairs );
+
+	// Resamples input to count samples of stereo output in out, and returns
+	// number written, which is less than count only if not enough input was
+	// written. If out is NULL, skips samples.
+	int read( sample_t* out, int count );
+
+public:
+	SPC_Resampler();
+
+private:
+	// Each output sample is a windowed sinc of taps input samples around it.
+	// Filter is precalculated for up to max_phases fractional positions
+	// between input samples.
+	enum { taps = 32 };
+	enum { max_phases = 512 };
+	enum { gain_bits = 14 };
+
+	// Enough input for max_read samples at min_rate, plus history
+	enum { buf_size = max_read / 2 * (in_rate / min_rate) + taps * 2 };
+
+	int out_rate;
+	int phases;     // phases in filter table
+	int step;       // whole input samples to advance per output sample
+	int step_frac;  // fraction of input sample, in 1/den
+	int den;
+	int frac;       // fractional position of next output, in 1/den
+	int buf_pos;    // first input sample of filter for next output
+	int buf_end;    // end of input written
+	alignas (16) short filter [max_phases] [taps];
+	alignas (16) sample_t buf [2] [buf_size];
+};
+
+#endif
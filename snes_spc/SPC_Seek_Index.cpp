@@ -0,0 +1,386 @@
+// snes_spc 0.9.0. http://www.slack.net/~ant/
+
+#include "SPC_Seek_Index.h"
+
+#if !SPC_NO_COPY_STATE_FUNCS
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Copyright (C) 2026 agent <agent@local>. This module is free software; you
+can redistribute it and/or modify it under the terms of the GNU Lesser
+General Public License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version. This
+module is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public License for more
+details. You should have received a copy of the GNU Lesser General Public
+License along with this module; if not, write to the Free Software Foundation,
+Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA */
+
+#include <cassert>
+
+SPC_Seek_Index::SPC_Seek_Index()
+{
+	states   = 0;
+	capacity = 0;
+	set_interval( 5 );
+}
+
+SPC_Seek_Index::~SPC_Seek_Index()
+{
+	free( states );
+}
+
+void SPC_Seek_Index::set_interval( int seconds )
+{
+	assert( seconds > 0 );
+	interval = (long) seconds * SNES_SPC::sample_rate * 2;
+	clear();
+}
+
+void SPC_Seek_Index::clear()
+{
+	count = 0;
+	pos   = 0;
+}
+
+static void write_state( unsigned char** io, void* state, size_t size )
+{
+	memcpy( *io, state, size );
+	*io += size;
+}
+
+static void read_state( unsigned char** io, void* state, size_t size )
+{
+	memcpy( state, *io, size );
+	*io += size;
+}
+
+blargg_err_t SPC_Seek_Index::add_checkpoint( SNES_SPC* emu )
+{
+	if ( count >= capacity )
+	{
+		int n = (capacity ? capacity * 2 : 32);
+		void* p = realloc( states, (long) n * slot_size );
+		if ( !p )
+			return "Out of memory";
+		states   = (unsigned char*) p;
+		capacity = n;
+	}
+
+	// Unused end of slot is cleared so it compresses away in save()
+	unsigned char* const slot = state( count );
+	unsigned char* out = slot;
+	emu->copy_state( &out, write_state );
+	assert( out <= slot + slot_size );
+	memset( out, 0, slot + slot_size - out );
+	count++;
+
+	return 0;
+}
+
+blargg_err_t SPC_Seek_Index::run( SNES_SPC* emu, long n, sample_t* out )
+{
+	// Like SNES_SPC::play(), runs all samples and returns first error
+	blargg_err_t first_err = 0;
+	for ( ;; )
+	{
+		long const next = (long) count * interval;
+		if ( pos == next )
+		{
+			blargg_err_t err = add_checkpoint( emu );
+			if ( err )
+				return err;
+		}
+
+		if ( !n )
+			return first_err;
+
+		// Stop at next checkpoint so it can be taken at a frame boundary
+		int chunk = (int) (n < interval ? n : interval);
+		if ( pos < next && chunk > next - pos )
+			chunk = (int) (next - pos);
+
+		blargg_err_t err;
+		if ( out )
+		{
+			err = emu->play( chunk, out );
+			out += chunk;
+		}
+		else
+		{
+			err = emu->skip( chunk );
+		}
+		pos += chunk;
+		n   -= chunk;
+		if ( !first_err )
+			first_err = err;
+	}
+}
+
+blargg_err_t SPC_Seek_Index::play( SNES_SPC* emu, int n, sample_t* out )
+{
+	assert( (n & 1) == 0 ); // must be even
+	return run( emu, n, out );
+}
+
+blargg_err_t SPC_Seek_Index::seek( SNES_SPC* emu, long new_pos )
+{
+	assert( (new_pos & 1) == 0 && new_pos >= 0 ); // must be even
+	if ( !count )
+		return "Seek index is empty";
+
+	int i = count - 1;
+	if ( new_pos / interval < i )
+		i = (int) (new_pos / interval);
+
+	unsigned char* in = state( i );
+	emu->copy_state( &in, read_state );
+	emu->set_output( 0, 0 );
+	pos = i * interval;
+
+	return run( emu, new_pos - pos, 0 );
+}
+
+// Sidecar file
+
+// Offset  Size    Data
+// - - - - - - - - - - - - - - - - - -
+//      0     8    "SPC_SEEK"
+//      8     4    Format version
+//     12     4    Size of each checkpoint (SNES_SPC::state_size)
+//     16     4    CRC-32 of SPC registers, RAM, DSP registers and IPL ROM
+//     20     4    Interval in samples
+//     24     4    Number of checkpoints
+//     28     4    CRC-32 of checkpoints
+//     32    ...   Checkpoints
+//
+// Numbers are little-endian. Each checkpoint is the 4-byte size of its data,
+// then its state XORed with previous checkpoint's (first with zeroes), as
+// repeated pairs of a run of zero bytes and a run of literal bytes. Run
+// lengths are stored 7 bits at a time, low bits first, with the high bit set
+// on all but the last byte.
+
+static char const seek_signature [8 + 1] = "SPC_SEEK";
+int const seek_header_size = 32;
+int const seek_version = 2; // increase when checkpoint layout changes
+
+static unsigned char* write_length( unsigned char* out, long n )
+{
+	while ( n >= 0x80 )
+	{
+		*out++ = (unsigned char) (n | 0x80);
+		n >>= 7;
+	}
+	*out++ = (unsigned char) n;
+	return out;
+}
+
+static unsigned char const* read_length( unsigned char const* in,
+		unsigned char const* end, long* n )
+{
+	long r = 0;
+	for ( int shift = 0; in < end && shift < 28; shift += 7 )
+	{
+		int b = *in++;
+		r |= (long) (b & 0x7F) << shift;
+		if ( !(b & 0x80) )
+		{
+			*n = r;
+			return in;
+		}
+	}
+	return 0;
+}
+
+static uint32_t update_crc( uint32_t crc, unsigned char const* in, long n )
+{
+	crc = ~crc;
+	while ( n-- )
+	{
+		crc ^= *in++;
+		for ( int i = 8; i--; )
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+// CRC-32 of the parts of SPC file data that affect emulation, so editing its
+// ID666 tag doesn't invalidate the index
+static uint32_t spc_checksum( void const* spc, long size )
+{
+	unsigned char const* const in = (unsigned char const*) spc;
+	if ( size > SNES_SPC::spc_file_size )
+		size = SNES_SPC::spc_file_size;
+
+	uint32_t crc = 0;
+	if ( size >= 0x2C )
+		crc = update_crc( crc, in + 0x25, 0x2C - 0x25 ); // PC, A, X, Y, PSW, SP
+	if ( size > 0x100 )
+		crc = update_crc( crc, in + 0x100, size - 0x100 );
+	return crc;
+}
+
+// State before first checkpoint, for XORing it with
+static unsigned char const zero_state [SNES_SPC::state_size] = { 0 };
+
+// Encodes cur XORed with prev, both size bytes, to out, or just finds size
+// if out is NULL. Returns bytes written.
+static long encode( unsigned char const* prev, unsigned char const* cur,
+		long size, unsigned char* out )
+{
+	long total = 0;
+	long i = 0;
+	while ( i < size )
+	{
+		long const zeros_begin = i;
+		while ( i < size && cur [i] == prev [i] )
+			i++;
+
+		// Literals continue over fewer than 3 unchanged bytes, which would
+		// take more bytes to encode as a run
+		long const literals_begin = i;
+		int same = 0;
+		while ( i < size && same < 3 )
+		{
+			same = (cur [i] == prev [i] ? same + 1 : 0);
+			i++;
+		}
+		i -= same;
+
+		unsigned char buf [10];
+		unsigned char* p = write_length( buf, literals_begin - zeros_begin );
+		p = write_length( p, i - literals_begin );
+		total += (p - buf) + (i - literals_begin);
+		if ( out )
+		{
+			memcpy( out, buf, p - buf );
+			out += p - buf;
+			for ( long k = literals_begin; k < i; k++ )
+				*out++ = cur [k] ^ prev [k];
+		}
+	}
+	return total;
+}
+
+// Decodes checkpoint data from in to end, XORing it with prev, to out, or
+// just checks it if out is NULL. Data must decode to exactly size bytes.
+static blargg_err_t decode( unsigned char const* in, unsigned char const* end,
+		unsigned char const* prev, unsigned char* out, long size )
+{
+	long j = 0;
+	while ( in < end )
+	{
+		long zeros, literals;
+		in = read_length( in, end, &zeros );
+		if ( in )
+			in = read_length( in, end, &literals );
+		if ( !in || zeros > size - j || literals > size - j - zeros ||
+				literals > end - in )
+			return "Corrupt seek index";
+
+		if ( out )
+		{
+			memcpy( out + j, prev + j, zeros );
+			for ( long k = 0; k < literals; k++ )
+				out [j + zeros + k] = prev [j + zeros + k] ^ in [k];
+		}
+		j  += zeros + literals;
+		in += literals;
+	}
+	if ( j != size )
+		return "Corrupt seek index";
+	return 0;
+}
+
+long SPC_Seek_Index::save_size() const
+{
+	long size = seek_header_size;
+	for ( int i = 0; i < count; i++ )
+		size += 4 + encode( (i ? state( i - 1 ) : zero_state), state( i ), slot_size, 0 );
+	return size;
+}
+
+void SPC_Seek_Index::save( void* out_, void const* spc, long spc_size ) const
+{
+	unsigned char* out = (unsigned char*) out_;
+	memcpy( out, seek_signature, 8 );
+	set_le32( out +  8, seek_version );
+	set_le32( out + 12, slot_size );
+	set_le32( out + 16, spc_checksum( spc, spc_size ) );
+	set_le32( out + 20, interval );
+	set_le32( out + 24, count );
+	unsigned char* const header = out;
+	out += seek_header_size;
+
+	unsigned char* const begin = out;
+	for ( int i = 0; i < count; i++ )
+	{
+		long n = encode( (i ? state( i - 1 ) : zero_state), state( i ), slot_size, out + 4 );
+		set_le32( out, n );
+		out += 4 + n;
+	}
+	set_le32( header + 28, update_crc( 0, begin, out - begin ) );
+}
+
+blargg_err_t SPC_Seek_Index::load( void const* data, long size,
+		void const* spc, long spc_size )
+{
+	unsigned char const* in  = (unsigned char const*) data;
+	unsigned char const* end = in + size;
+	if ( size < seek_header_size || memcmp( in, seek_signature, 8 ) )
+		return "Not a seek index";
+
+	if ( get_le32( in + 8 ) != seek_version || get_le32( in + 12 ) != slot_size )
+		return "Unsupported seek index version";
+
+	if ( get_le32( in + 16 ) != spc_checksum( spc, spc_size ) )
+		return "Seek index is for a different SPC file";
+
+	long const new_interval = get_le32( in + 20 );
+	long const new_count    = get_le32( in + 24 );
+	if ( new_interval <= 0 || (new_interval & 1) || new_count > (size - seek_header_size) / 4 )
+		return "Corrupt seek index";
+	uint32_t const crc = get_le32( in + 28 );
+	in += seek_header_size;
+
+	// Check all checkpoints first so index is left unchanged on error
+	unsigned char const* const begin = in;
+	for ( int i = 0; i < new_count; i++ )
+	{
+		if ( end - in < 4 || (long) get_le32( in ) > end - in - 4 )
+			return "Corrupt seek index";
+		unsigned char const* const data_end = in + 4 + get_le32( in );
+		blargg_err_t err = decode( in + 4, data_end, 0, 0, slot_size );
+		if ( err )
+			return err;
+		in = data_end;
+	}
+	if ( update_crc( 0, begin, in - begin ) != crc )
+		return "Corrupt seek index";
+
+	if ( new_count > capacity )
+	{
+		void* p = realloc( states, new_count * slot_size );
+		if ( !p )
+			return "Out of memory";
+		states   = (unsigned char*) p;
+		capacity = (int) new_count;
+	}
+
+	clear();
+	interval = new_interval;
+	count    = (int) new_count;
+	in = begin;
+	for ( int i = 0; i < count; i++ )
+	{
+		unsigned char const* const data_end = in + 4 + get_le32( in );
+		decode( in + 4, data_end, (i ? state( i - 1 ) : zero_state), state( i ), slot_size );
+		in = data_end;
+	}
+
+	return 0;
+}
+
+#endif
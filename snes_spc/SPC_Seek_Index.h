@@ -0,0 +1,85 @@
+// Index of SNES_SPC states at regular intervals, for quick seeking in SPC music
+
+// snes_spc 0.9.0
+#ifndef SPC_SEEK_INDEX_H
+#define SPC_SEEK_INDEX_H
+
+#include "SNES_SPC.h"
+
+#if !SPC_NO_COPY_STATE_FUNCS
+
+// Play through a song with play() once to take a checkpoint of the emulator's
+// state every interval. seek() then restores the last checkpoint at or before
+// a position and skips forward from there, rather than from the beginning.
+// Positions are in samples, as counted by SNES_SPC::play(). Index must only be
+// used with the SPC file and settings it was made with. Like copy_state(),
+// results are only exact with the accurate DSP engine.
+struct SPC_Seek_Index {
+public:
+
+	// Sets seconds between checkpoints and clears index. Default is 5.
+	void set_interval( int seconds );
+
+	// Clears index. Next play() takes first checkpoint, so call after
+	// loading SPC and before playing it.
+	void clear();
+
+	// Plays count samples with emu->play(), adding checkpoints when position
+	// reaches one not yet taken
+	typedef SNES_SPC::sample_t sample_t;
+	blargg_err_t play( SNES_SPC* emu, int count, sample_t* out );
+
+	// Restores emu to position pos using last checkpoint at or before it, then
+	// skips to pos, adding checkpoints past the last one. Output is reset as
+	// with SNES_SPC::skip().
+	blargg_err_t seek( SNES_SPC* emu, long pos );
+
+	// Current position of emulator in samples
+	long position() const                   { return pos; }
+
+	// Number of checkpoints taken
+	int checkpoint_count() const            { return count; }
+
+// Sidecar file
+
+	// Number of bytes save() writes
+	long save_size() const;
+
+	// Writes index to out in compact form, for saving to a file next to the
+	// SPC file so later plays can seek without a first pass. spc is the SPC
+	// file data the index was made with.
+	void save( void* out, void const* spc, long spc_size ) const;
+
+	// Loads index written by save(). Fails if it was written by a different
+	// version of the library or for different SPC file data, or if it has been
+	// damaged, leaving index unchanged. Checkpoints are restored without being
+	// checked further, so don't load an index from an untrusted source.
+	// Position is left at 0, so emulator should be freshly loaded.
+	blargg_err_t load( void const* in, long size, void const* spc, long spc_size );
+
+public:
+	SPC_Seek_Index();
+	~SPC_Seek_Index();
+
+private:
+	// Checkpoint i is the state at position i * interval, stored whole so
+	// seek() only needs to copy one
+	enum { slot_size = SNES_SPC::state_size };
+	unsigned char* states;
+	int count;
+	int capacity;
+	long interval;
+	long pos;
+
+	// Can't be copied
+	SPC_Seek_Index( const SPC_Seek_Index& );
+	SPC_Seek_Index& operator = ( const SPC_Seek_Index& );
+
+	blargg_err_t add_checkpoint( SNES_SPC* );
+	blargg_err_t run( SNES_SPC*, long count, sample_t* out );
+	unsigned char* state( int i ) const     { return states + (long) i * slot_size; }
+};
+
+#endif
+
+#endif